@@ -11,10 +11,12 @@
  * This driver consists of:
  *
  * - a main thread (_gs_loop) that has exclusive access to the serial port in input
- * - a mechanism based on slots (GSlot) such that each thread calling into the driver must wait its turn to issue an AT command
+ * - a mechanism based on slots (GSlot) such that each thread calling into the driver must wait its turn to issue an AT command.
+ *   Each caller gets its own slot from a pool of MAX_SLOTS and slots are queued in FIFO order: the head of the queue is the only one
+ *   with a command in flight (the module accepts one AT command at a time), so responses always belong to the head slot
  * - a list of socket structures (GSocket)
  *
- * The main thread reads one line at time and checks if it is a command response or not. In case it is a command response, it tries
+ * The main thread drains the serial port into a ring buffer (gs.rxring), splits it one line at time and checks if it is a command response or not. In case it is a command response, it tries
  * to handle it based on the current slot. If the command response is a URC, it is handled by the corresponding functon (_gs_handle_urc),
  * otherwise if the line is not a command response, it is checked against "OK", "+CME ERROR", "ERROR" or ">" and action on the current slot
  * is taken.
@@ -48,9 +50,24 @@
 GStatus gs;
 //the list of available sockets
 static GSocket gs_sockets[MAX_SOCKS];
-//the one and only slot available to threads
+//the pool of socket buffers, claimed on socket creation
+static uint8_t gs_rxpool[GS_SOCK_POOL][MAX_SOCK_RX_BUF];
+static uint8_t gs_txpool[GS_SOCK_POOL][MAX_SOCK_TX_BUF];
+//bitmask of the pool entries in use (protected by gs.ringlock)
+static uint32_t gs_poolused;
+//digests of the files uploaded to the module
+static GSFileDigest gs_fdigests[MAX_FILE_DIGESTS];
+//next digest entry to recycle when the cache is full
+static int gs_fdigestnext;
+//set when the certificate store has been listed since the module started (protected by gs.fslock)
+static uint8_t gs_certscanned;
+//the ssl contexts of the module
+static GSSslCtx gs_sslctx[GS_SSL_CTXS];
+//the pool of slots available to threads
 //to get the ug96 driver attention
-static GSSlot gslot;
+static GSSlot gs_slots[MAX_SLOTS];
+//per slot semaphores signaled when the slot reaches the head of the queue
+static VSemaphore gs_slotturn[MAX_SLOTS];
 //the list of GSM operators
 GSOp gsops[MAX_OPS];
 //the number of GSM operators
@@ -59,6 +76,16 @@ int gsopn=0;
 //Some declarations for URC socket handling
 void _gs_socket_closing(int id);
 void _gs_socket_pending(int id);
+void _gs_socket_push(int id, int len, struct sockaddr_in* addr);
+void _gs_exit_transparent_mode(int id);
+int _gs_transparent_send(int id, uint8_t* buf, int len);
+int _gs_transparent_recv(int id, uint8_t* buf, int len, int timeout);
+void _gs_worker_wake(int id);
+void _gs_socket_rxready(int id, int ready);
+void _gs_worker_flush(int id, int arm);
+int _gs_socket_flush_nolock(int id, int nowait);
+int _gs_socket_wait_window_nolock(int id, int len, uint32_t timeout);
+void _gs_cert_listed(uint8_t* resp, uint8_t* eresp);
 
 /**
  * @brief Initializes the data structures of ug96
@@ -71,14 +98,27 @@ void _gs_init(void)
         for (i = 0; i < MAX_SOCKS; i++) {
             gs_sockets[i].lock = vosSemCreate(1);
             gs_sockets[i].rx = vosSemCreate(0);
+            gs_sockets[i].opened = vosSemCreate(0);
         }
         memset(&gs, 0, sizeof(GStatus));
+        for (i = 0; i < MAX_SLOTS; i++) {
+            gs_slotturn[i] = vosSemCreate(0);
+        }
+        gs.slotqlock = vosSemCreate(1);
+        gs.slotfree = vosSemCreate(MAX_SLOTS);
         gs.slotlock = vosSemCreate(1);
         gs.sendlock = vosSemCreate(1);
         gs.slotdone = vosSemCreate(0);
         gs.bufmode = vosSemCreate(0);
+        gs.prompt = vosSemCreate(0);
+        gs.bufready = vosSemCreate(0);
         gs.dnsmode = vosSemCreate(1);
         gs.selectlock = vosSemCreate(0);
+        gs.rxevt = vosSemCreate(0);
+        gs.ringlock = vosSemCreate(1);
+        gs.workevt = vosSemCreate(0);
+        gs.fslock = vosSemCreate(1);
+        gs.ssllock = vosSemCreate(1);
         gs.pendingsms = 0;
         gs.initialized = 1;
         gs.talking = 0;
@@ -133,6 +173,9 @@ int _gs_stop(void)
     }
     if (gs.running)
         return GS_ERR_INVALID;
+    //the loop no longer owns the serial port: forget any partial data
+    gs.rxhead = 0;
+    gs.rxlen = 0;
     printf("stopped.\n");
     return GS_ERR_OK;
 }
@@ -144,7 +187,11 @@ int _gs_stop(void)
  */
 void _gs_empty_rx(void)
 {
-    int bytes = vhalSerialAvailable(gs.serial);
+    int bytes;
+    //drop what is already in the rx ring
+    gs.rxhead = 0;
+    gs.rxlen = 0;
+    bytes = vhalSerialAvailable(gs.serial);
     while (bytes > 0) {
         bytes = MIN(bytes, MAX_BUF - 1);
         vhalSerialRead(gs.serial, gs.buffer, bytes);
@@ -159,12 +206,167 @@ void _gs_empty_rx(void)
     gs.bytes = 0;
 }
 
+/**
+ * @brief Move all the bytes buffered by the serial driver into the rx ring
+ *
+ * The free space of the ring is at most split in two contiguous regions, therefore
+ * no more than two vhalSerialRead are issued, regardless of the number of bytes available.
+ *
+ * @return the number of bytes in the rx ring
+ */
+int _gs_rx_fill(void)
+{
+    int avail = vhalSerialAvailable(gs.serial);
+    int tail, chunk;
+
+    while (avail > 0 && gs.rxlen < MAX_RX_RING) {
+        tail = (gs.rxhead + gs.rxlen) % MAX_RX_RING;
+        chunk = MIN(avail, MAX_RX_RING - gs.rxlen);
+        chunk = MIN(chunk, MAX_RX_RING - tail);
+        vhalSerialRead(gs.serial, gs.rxring + tail, chunk);
+        gs.rxlen += chunk;
+        avail -= chunk;
+        gs.rxtime = vosMillis();
+    }
+    return gs.rxlen;
+}
+
+/**
+ * @brief Wake up the modem thread if it is waiting for serial data
+ *
+ * Called by threads that expect an answer from the module (e.g. after sending an AT command):
+ * the link is considered busy from now on, as if a byte had been received.
+ */
+void _gs_rx_wakeup(void)
+{
+    gs.rxtime = vosMillis();
+    vosSemSignal(gs.rxevt);
+}
+
+/**
+ * @brief Suspend the caller until new serial data may be available
+ *
+ * The serial driver does not notify incoming bytes, therefore the wait is a poll on gs.rxevt
+ * whose period adapts to the link activity: GS_RX_POLL_FAST if bytes have been received (or a command
+ * sent) in the last GS_RX_HOT_TIME milliseconds, GS_RX_POLL_IDLE otherwise. Slots waiting long for a urc
+ * (e.g. QIOPEN) go back to the idle period. An idle wait is cut short by _gs_rx_wakeup as soon as a
+ * response is expected.
+ *
+ * @param[in] maxwait   the maximum number of milliseconds to wait
+ */
+void _gs_wait_rx(int maxwait)
+{
+    int period = GS_RX_POLL_IDLE;
+
+    if ((vosMillis() - gs.rxtime) < GS_RX_HOT_TIME)
+        period = GS_RX_POLL_FAST;
+    if (period > maxwait)
+        period = maxwait;
+    if (period <= 0)
+        period = 1;
+    vosSemWaitTimeout(gs.rxevt, TIME_U(period, MILLIS));
+}
+
+/**
+ * @brief Remove bytes from the head of the rx ring
+ *
+ * @param[in] bytes the number of bytes to remove (must be <= gs.rxlen)
+ */
+void _gs_rx_consume(int bytes)
+{
+    gs.rxlen -= bytes;
+    if (!gs.rxlen) {
+        //restart from the beginning to keep the free space contiguous
+        gs.rxhead = 0;
+    } else {
+        gs.rxhead = (gs.rxhead + bytes) % MAX_RX_RING;
+    }
+}
+
+/**
+ * @brief Read exactly len bytes from the module
+ *
+ * Bytes already drained in the rx ring are returned first, the remaining ones
+ * are read directly from the serial port (blocking). Use it instead of vhalSerialRead
+ * whenever data must be read while _gs_loop is not reading lines (e.g. buffer mode).
+ *
+ * @param[out] buf  where to store the bytes
+ * @param[in]  len  the number of bytes to read
+ *
+ * @return the number of bytes read
+ */
+int _gs_serial_read(uint8_t* buf, int len)
+{
+    int chunk, rd = 0;
+
+    while (gs.rxlen && rd < len) {
+        chunk = MIN(gs.rxlen, MAX_RX_RING - gs.rxhead);
+        chunk = MIN(chunk, len - rd);
+        memcpy(buf + rd, gs.rxring + gs.rxhead, chunk);
+        _gs_rx_consume(chunk);
+        rd += chunk;
+    }
+    if (rd < len) {
+        vhalSerialRead(gs.serial, buf + rd, len - rd);
+    }
+    return len;
+}
+
+/**
+ * @brief Discard exactly len bytes from the module
+ *
+ * Bytes in the rx ring are dropped without copying, the remaining ones are read
+ * from the serial port in gs.buffer sized chunks. Only call it while _gs_loop
+ * is not reading lines (gs.buffer is free).
+ *
+ * @param[in] len the number of bytes to discard
+ */
+void _gs_serial_skip(int len)
+{
+    int chunk;
+
+    chunk = MIN(gs.rxlen, len);
+    _gs_rx_consume(chunk);
+    len -= chunk;
+    while (len > 0) {
+        chunk = MIN(len, MAX_BUF);
+        vhalSerialRead(gs.serial, gs.buffer, chunk);
+        len -= chunk;
+    }
+}
+
+/**
+ * @brief Checks if the current slot is waiting for the "> " prompt
+ *
+ * @return 0 if no prompt is expected
+ */
+int _gs_slot_expects_prompt(void)
+{
+    return gs.slot && (gs.slot->cmd->id == GS_CMD_QISEND || gs.slot->cmd->id == GS_CMD_QSSLSEND || gs.slot->cmd->id == GS_CMD_CMGS);
+}
+
+/**
+ * @brief Checks if gs.buffer contains the "> " prompt
+ *
+ * The prompt is not followed by a line terminator, so it must be recognized as soon as it arrives.
+ *
+ * @return 0 on failure
+ */
+int _gs_check_prompt(void)
+{
+    return gs.bytes >= 1 && gs.bytes <= 2 && gs.buffer[0] == '>' && _gs_slot_expects_prompt();
+}
+
 /**
  * @brief Read a line from the module
  *
  * Lines are saved into gs.buffer and null terminated. The number of bytes read 
- * is saved in gs.bytes and returned. The timeout is implemented with a 50 milliseconds
- * polling strategy. TODO: change when the serial driver will support timeouts
+ * is saved in gs.bytes and returned. Incoming bytes are drained in bulk into the rx ring
+ * and lines are split from there, so that the serial driver is called once per burst
+ * instead of once per byte. While no data is available the caller is suspended in _gs_wait_rx.
+ * Partial lines that are complete tokens by themselves (the "> " prompt) are returned as soon as
+ * they are received, without waiting for a terminator or for the timeout.
+ * TODO: change when the serial driver will support timeouts
  *
  * @param[in]   timeout     the number of milliseconds to wait for a line
  *
@@ -172,32 +374,45 @@ void _gs_empty_rx(void)
  */
 int _gs_readline(int timeout)
 {
+    uint8_t *src, *nl;
+    int chunk;
     gs.bytes = 0;
     memset(gs.buffer, 0, 16);
-    uint8_t* buf = gs.buffer;
     uint32_t tstart = vosMillis();
     while (gs.bytes < (MAX_BUF - 1)) {
-        if (timeout > 0) {
-            if ((vosMillis() - tstart) > timeout) {
-                *buf = 0;
-                return -1;
-            }
-            if (vhalSerialAvailable(gs.serial) > 0) {
-                vhalSerialRead(gs.serial, buf, 1);
-            } else {
-                vosThSleep(TIME_U(50, MILLIS));
+        if (!gs.rxlen && !_gs_rx_fill()) {
+            if (_gs_check_prompt())
+                break;
+            if (timeout > 0) {
+                uint32_t elapsed = vosMillis() - tstart;
+                if (elapsed > timeout) {
+                    gs.buffer[gs.bytes] = 0;
+                    return -1;
+                }
+                _gs_wait_rx(timeout - elapsed);
                 continue;
             }
-        } else {
-            vhalSerialRead(gs.serial, buf, 1);
+            //no timeout: block until something arrives
+            vhalSerialRead(gs.serial, gs.rxring, 1);
+            gs.rxhead = 0;
+            gs.rxlen = 1;
+            _gs_rx_fill();
         }
-        gs.bytes++;
-        //        printf("->%i\n",gs.bytes);
-        if (*buf++ == '\n')
+        //split the line from the contiguous part of the ring
+        src = gs.rxring + gs.rxhead;
+        chunk = MIN(gs.rxlen, MAX_RX_RING - gs.rxhead);
+        chunk = MIN(chunk, (MAX_BUF - 1) - gs.bytes);
+        nl = memchr(src, '\n', chunk);
+        if (nl)
+            chunk = nl - src + 1;
+        memcpy(gs.buffer + gs.bytes, src, chunk);
+        _gs_rx_consume(chunk);
+        gs.bytes += chunk;
+        if (nl)
             break;
     }
     //terminate for debugging!
-    *buf = 0;
+    gs.buffer[gs.bytes] = 0;
     printf("rl: %s", gs.buffer);
     return gs.bytes;
 }
@@ -215,9 +430,9 @@ int _gs_read(int bytes)
 {
     memset(gs.buffer, 0, 16);
     if (bytes <= 0)
-        bytes = vhalSerialAvailable(gs.serial);
+        bytes = _gs_rx_fill();
     gs.bytes = MIN(bytes, MAX_BUF - 1);
-    vhalSerialRead(gs.serial, gs.buffer, gs.bytes);
+    _gs_serial_read(gs.buffer, gs.bytes);
     //terminate for debugging!
     gs.buffer[gs.bytes + 1] = 0;
     //printf("rn: %s\n",gs.buffer);
@@ -547,6 +762,8 @@ void _gs_send_at(int cmd_id, const char* fmt, ...)
     vhalSerialWrite(gs.serial, "\r", 1);
     printf("\n");
     vosSemSignal(gs.sendlock);
+    //a response is coming
+    _gs_rx_wakeup();
     va_end(vl);
 }
 
@@ -762,8 +979,23 @@ void _gs_handle_urc(GSCmd* cmd)
             _gs_socket_closing(p1);
         } else if (p0 == 6 && memcmp(s0, "\"recv\"", p0) == 0) {
             //data ready!
-            _gs_parse_command_arguments(buf, ebuf, "si", &s0, &p0, &p1);
-            _gs_socket_pending(p1);
+            if (_gs_parse_command_arguments(buf, ebuf, "sii", &s0, &p0, &p1, &p2) == 3) {
+                //direct push mode: the payload follows the urc
+                //+QIURC: "recv",<id>,<len> for tcp and udp clients
+                //+QIURC: "recv",<id>,<len>,"<remote ip>",<remote port> for udp services (sockets bound with access mode 1)
+                struct sockaddr_in addr;
+                int32_t port;
+                memset(&addr, 0, sizeof(addr));
+                if (_gs_parse_command_arguments(buf, ebuf, "siisi", &s0, &p0, &p1, &p2, &s1, &p3, &port) == 5 && p3 > 2) {
+                    //udp service: the sender address follows the length
+                    zs_string_to_addr(s1 + 1, MIN(15, p3 - 2), &addr);
+                    addr.sin_port = OAL_GET_NETPORT(port);
+                }
+                _gs_socket_push(p1, p2, &addr);
+            } else {
+                _gs_parse_command_arguments(buf, ebuf, "si", &s0, &p0, &p1);
+                _gs_socket_pending(p1);
+            }
         } else if (p0 == 8 && memcmp(s0, "\"dnsgip\"", p0) == 0) {
             //dns ready!
             _gs_parse_command_arguments(buf, ebuf, "ss", &s0, &p0, &s1, &p1);
@@ -833,11 +1065,42 @@ exit_err:
     return;
 }
 
+uint8_t _slotbuf[MAX_CMD];
+
+/**
+ * @brief Fill an acquired slot and make it the current one
+ */
+void _gs_slot_setup(GSSlot* slot, int cmd_id, uint8_t* respbuf, int max_size, int timeout, int nparams)
+{
+    slot->cmd = GS_GET_CMD(cmd_id);
+    slot->stime = vosMillis();
+    slot->timeout = timeout;
+    slot->has_params = nparams;
+    if (!respbuf) {
+        if (max_size) {
+            slot->resp = _slotbuf; //gc_malloc(max_size);
+            slot->eresp = slot->resp;
+        } else {
+            slot->resp = slot->eresp = NULL;
+        }
+        slot->allocated = 1;
+        slot->max_size = max_size;
+    } else {
+        slot->resp = slot->eresp = respbuf;
+        slot->max_size = max_size;
+        slot->allocated = 0;
+    }
+
+    gs.slot = slot;
+}
+
 /**
  * @brief Wait for a slot to be available and acquires it
  *
- * A slot (or actually the slot, since in this implementation it is unique) is a structure holding information about the last issued command.
- * It also contains a buffer to hold the command response. Such buffer can be passed as an argument or (by passing NULL and a size) allocated by
+ * A slot is a structure holding information about the last issued command. Slots are taken from a pool and queued
+ * in FIFO order, so that threads get the serial port in the same order they asked for it. Since the module processes
+ * one AT command at a time, only the head of the queue is active and the main thread matches every response to it.
+ * The slot also contains a buffer to hold the command response. Such buffer can be passed as an argument or (by passing NULL and a size) allocated by
  * the driver. In this case it will be deallocated on slot release. Acquiring a slot is a blocking operation and no other thread can access the serial port
  * until the slot is released.
  *
@@ -849,31 +1112,71 @@ exit_err:
  *
  * @return a pointer to the acquired slot
  */
-uint8_t _slotbuf[MAX_CMD];
 GSSlot* _gs_acquire_slot(int cmd_id, uint8_t* respbuf, int max_size, int timeout, int nparams)
 {
-    vosSemWait(gs.slotlock);
-    gslot.cmd = GS_GET_CMD(cmd_id);
-    gslot.stime = vosMillis();
-    gslot.timeout = timeout;
-    gslot.has_params = nparams;
-    if (!respbuf) {
-        if (max_size) {
-            gslot.resp = _slotbuf; //gc_malloc(max_size);
-            gslot.eresp = gslot.resp;
-        } else {
-            gslot.resp = gslot.eresp = NULL;
+    GSSlot* slot = NULL;
+    int i, first;
+
+    //take a slot from the pool and queue it
+    vosSemWait(gs.slotfree);
+    vosSemWait(gs.slotqlock);
+    for (i = 0; i < MAX_SLOTS; i++) {
+        if (!gs_slots[i].busy) {
+            slot = &gs_slots[i];
+            break;
         }
-        gslot.allocated = 1;
-        gslot.max_size = max_size;
-    } else {
-        gslot.resp = gslot.eresp = respbuf;
-        gslot.max_size = max_size;
-        gslot.allocated = 0;
     }
+    slot->busy = 1;
+    gs.slotq[(gs.slotqhead + gs.slotqlen) % MAX_SLOTS] = i;
+    gs.slotqlen++;
+    first = (gs.slotqlen == 1);
+    vosSemSignal(gs.slotqlock);
+
+    if (!first) {
+        //wait for the previous slots to be released
+        vosSemWait(gs_slotturn[i]);
+    }
+    //the serial port can also be held outside of slots (startup, bypass, transparent mode)
+    vosSemWait(gs.slotlock);
+
+    _gs_slot_setup(slot, cmd_id, respbuf, max_size, timeout, nparams);
+    return slot;
+}
+
+/**
+ * @brief Acquire a slot only if the serial port is free right now
+ *
+ * Same as _gs_acquire_slot, but it never waits: used by non blocking sockets.
+ *
+ * @return a pointer to the acquired slot, or NULL if other slots are queued or the serial port is held
+ */
+GSSlot* _gs_try_acquire_slot(int cmd_id, uint8_t* respbuf, int max_size, int timeout, int nparams)
+{
+    GSSlot* slot = NULL;
+    int i;
 
-    gs.slot = &gslot;
-    return &gslot;
+    if (vosSemWaitTimeout(gs.slotfree, TIME_U(0, MILLIS)) == VRES_TIMEOUT)
+        return NULL;
+    vosSemWait(gs.slotqlock);
+    if (!gs.slotqlen && vosSemWaitTimeout(gs.slotlock, TIME_U(0, MILLIS)) != VRES_TIMEOUT) {
+        for (i = 0; i < MAX_SLOTS; i++) {
+            if (!gs_slots[i].busy) {
+                slot = &gs_slots[i];
+                break;
+            }
+        }
+        //the queue is empty: this slot is the head
+        slot->busy = 1;
+        gs.slotq[gs.slotqhead] = i;
+        gs.slotqlen = 1;
+    }
+    vosSemSignal(gs.slotqlock);
+    if (!slot) {
+        vosSemSignal(gs.slotfree);
+        return NULL;
+    }
+    _gs_slot_setup(slot, cmd_id, respbuf, max_size, timeout, nparams);
+    return slot;
 }
 
 /**
@@ -900,14 +1203,17 @@ void _gs_wait_for_slot(void)
  */
 int _gs_wait_for_slot_mode(uint8_t* text, int32_t textlen, uint8_t* addtxt, int addtxtlen)
 {
-    //can be polled!
     int cnt = 0;
+    uint32_t tstart = vosMillis();
     printf("Waiting for mode\n");
 
     // vhalSerialWrite(gs.serial,">",1);
-    while (gs.mode == GS_MODE_NORMAL && cnt < 100) { //after 10 seconds, timeout
-        vosThSleep(TIME_U(100, MILLIS));
-        cnt++;
+    while (gs.mode != GS_MODE_PROMPT) {
+        cnt = 10000 - (int)(vosMillis() - tstart);
+        if (cnt <= 0) //after 10 seconds, timeout
+            break;
+        //signaled by the main thread when the prompt arrives
+        vosSemWaitTimeout(gs.prompt, TIME_U(cnt, MILLIS));
     }
 
     if (gs.mode != GS_MODE_PROMPT)
@@ -935,18 +1241,22 @@ int _gs_wait_for_slot_mode(uint8_t* text, int32_t textlen, uint8_t* addtxt, int
         printf("Remaining %i\n", addtxtlen);
     }
     gs.mode = GS_MODE_NORMAL; //back to normal mode
+    vosSemSignal(gs.bufmode);
 
     return 0;
 }
 
 int _gs_wait_for_buffer_mode(void)
 {
-    //can be polled!
-    int cnt = 0;
+    int cnt;
+    uint32_t tstart = vosMillis();
     printf("Waiting for buffer mode\n");
-    while (gs.mode != GS_MODE_BUFFER && cnt < 100) { //after 10 seconds, timeout
-        vosThSleep(TIME_U(100, MILLIS));
-        cnt++;
+    while (gs.mode != GS_MODE_BUFFER) {
+        cnt = 10000 - (int)(vosMillis() - tstart);
+        if (cnt <= 0) //after 10 seconds, timeout
+            break;
+        //signaled by the main thread when buffer mode is entered
+        vosSemWaitTimeout(gs.bufready, TIME_U(cnt, MILLIS));
     }
 
     return gs.mode == GS_MODE_BUFFER;
@@ -971,52 +1281,95 @@ int _gs_exit_from_buffer_mode_w(uint8_t* buf, int len)
     return 0;
 }
 
+/**
+ * @brief Read a QIRD/QSSLRECV payload and leave buffer mode
+ *
+ * The first len bytes go to buf, the rest of the max bytes announced by the module
+ * are appended to the socket ring (if sock is given and there is room) or discarded.
+ * Every destination is filled with at most two contiguous reads.
+ *
+ * @param[out] buf  where to store the payload (can be NULL)
+ * @param[in]  len  size of buf
+ * @param[in]  max  the number of bytes announced by the module
+ * @param[in]  sock the socket whose ring receives the surplus (can be NULL)
+ *
+ * @return 0 on success
+ */
 int _gs_exit_from_buffer_mode_r(uint8_t* buf, int len, int max, GSocket* sock)
 {
+    int tail, room, chunk;
 
+    if (!buf || len < 0)
+        len = 0;
     if (max < len)
         len = max;
-    if (buf && len) {
-        printf("bmode read %i\n", len);
-        int rd = vhalSerialRead(gs.serial, buf, len);
-        printf("sock %x %i %i %i\n", sock, max, len, rd);
-        if (sock) {
-            int pos=-1;
-            while (max > len) {
-                pos = (sock->head + sock->len) % MAX_SOCK_RX_BUF;
-                printf("bmode read 1 at %i/%i pos %i\n", sock->head, sock->len, pos);
-                vhalSerialRead(gs.serial, sock->rxbuf + pos, 1);
-                sock->len++;
-                max--;
-            }
+    printf("bmode read %i/%i\n", len, max);
+    if (len) {
+        _gs_serial_read(buf, len);
+        max -= len;
+    }
+    if (sock && max > 0) {
+        //move the surplus in the socket ring, split at the wrap point
+        vosSemWait(gs.ringlock);
+        tail = (sock->head + sock->len) % sock->rxsize;
+        room = sock->rxsize - sock->len;
+        vosSemSignal(gs.ringlock);
+        room = MIN(room, max);
+        if (room > 0) {
+            chunk = MIN(room, sock->rxsize - tail);
+            _gs_serial_read(sock->rxbuf + tail, chunk);
+            if (room > chunk)
+                _gs_serial_read(sock->rxbuf, room - chunk);
+            vosSemWait(gs.ringlock);
+            sock->len += room;
+            vosSemSignal(gs.ringlock);
+            max -= room;
             //signal that there is pending data in the buffer
-            if(pos>=0) vosSemSignal(gs.selectlock);
-        } else {
-            while (max > len) {
-                //skip up to max
-                uint8_t dummy;
-                vhalSerialRead(gs.serial, &dummy, 1);
-                max--;
-            }
+            vosSemSignal(gs.selectlock);
         }
     }
+    if (max > 0) {
+        //skip up to max
+        printf("bmode skip %i\n", max);
+        _gs_serial_skip(max);
+    }
     gs.mode = GS_MODE_NORMAL;
     vosSemSignal(gs.bufmode);
     return 0;
 }
 
+/**
+ * @brief Remove an acquired slot from the queue without releasing the serial port
+ *
+ * The next queued slot (if any) becomes the head and starts waiting for gs.slotlock.
+ *
+ * @param[in] slot the slot to dequeue
+ */
+void _gs_dequeue_slot(GSSlot* slot)
+{
+    // if (slot->allocated && slot->resp) gc_free(slot->resp);
+    memset(slot, 0, sizeof(GSSlot));
+    vosSemWait(gs.slotqlock);
+    gs.slotqhead = (gs.slotqhead + 1) % MAX_SLOTS;
+    gs.slotqlen--;
+    if (gs.slotqlen) {
+        vosSemSignal(gs_slotturn[gs.slotq[gs.slotqhead]]);
+    }
+    vosSemSignal(gs.slotqlock);
+    vosSemSignal(gs.slotfree);
+}
+
 /**
  * @brief Release an acquired slot
  *
- * Deallocate slot memory if needed
+ * Deallocate slot memory if needed and pass the serial port to the next queued slot
  *
  * @param[in] slot the slot to release
  */
 void _gs_release_slot(GSSlot* slot)
 {
-    // if (slot->allocated && slot->resp) gc_free(slot->resp);
-    memset(slot, 0, sizeof(GSSlot));
     vosSemSignal(gs.slotlock);
+    _gs_dequeue_slot(slot);
 }
 
 /**
@@ -1107,11 +1460,11 @@ void _gs_loop(void* args)
         // printf("looping\n");
         if (gs.mode == GS_MODE_NORMAL) {
             if (_gs_readline(100) <= 3) {
-                if (
-                    gs.bytes >= 1 && gs.buffer[0] == '>' && gs.slot && (gs.slot->cmd->id == GS_CMD_QISEND || gs.slot->cmd->id == GS_CMD_QSSLSEND || gs.slot->cmd->id == GS_CMD_CMGS)) {
+                if (_gs_check_prompt()) {
                     //only enter in prompt mode if the current slot is for QISEND/CMGS to avoid locks
                     printf("GOT PROMPT!\n");
                     gs.mode = GS_MODE_PROMPT;
+                    vosSemSignal(gs.prompt);
                     continue;
                 }
                 //no line
@@ -1138,6 +1491,10 @@ void _gs_loop(void* args)
                                 //it's a QIRD response, enter read buffer mode!
                                 //unless it's just a check
                                 gs.mode = GS_MODE_BUFFER;
+                                vosSemSignal(gs.bufready);
+                            } else if (cmd->id == GS_CMD_QFLST) {
+                                //one line per file
+                                _gs_cert_listed(gs.slot->resp, gs.slot->eresp);
                             } else if (cmd->id == GS_CMD_CMGL) {
                                 int idx;
                                 uint8_t *sta, *oa, *alpha, *scts;
@@ -1194,7 +1551,7 @@ void _gs_loop(void* args)
                         if (gs.slot->has_params == gs.slot->params) {
                             _gs_slot_ok();
                         } else {
-                            if (gs.slot->cmd->id == GS_CMD_CMGL || gs.slot->cmd->id == GS_CMD_QENG) {
+                            if (gs.slot->cmd->id == GS_CMD_CMGL || gs.slot->cmd->id == GS_CMD_QENG || gs.slot->cmd->id == GS_CMD_QFLST) {
                                 //variable args
                                 _gs_slot_ok();
                             } else {
@@ -1216,6 +1573,11 @@ void _gs_loop(void* args)
                         if (gs.slot->cmd->id == GS_CMD_QFUPL && memcmp(gs.buffer, "CONNECT", 7) == 0) {
                             // go in buffer mode
                             gs.mode = GS_MODE_BUFFER;
+                            vosSemSignal(gs.bufready);
+                        } else if (gs.slot->cmd->id == GS_CMD_QIOPEN && memcmp(gs.buffer, "CONNECT", 7) == 0) {
+                            // transparent access mode: from now on the serial port carries raw socket data
+                            gs.mode = GS_MODE_TRANSPARENT;
+                            _gs_slot_ok();
                         } else if (gs.slot->cmd->id == GS_CMD_CMGL) {
                             //it's a line of text, read the sms
                             if (gs.skipsms) {
@@ -1249,19 +1611,25 @@ void _gs_loop(void* args)
             //// PROMPT MODE
             //Prompt mode is used for USECMNG (implemented) and DWNFILE (not implemented)
             //If needed, logic for prompt mode goes here
+            uint32_t tstart = vosMillis();
             int ss;
-            for (ss = 0; ss < 40; ss++) {
+            while (gs.mode == GS_MODE_PROMPT) {
                 //avoid locking, max time spendable in prompt mode = 20s
-                vosThSleep(TIME_U(500, MILLIS));
-                if (gs.mode != GS_MODE_PROMPT)
+                ss = 20000 - (int)(vosMillis() - tstart);
+                if (ss <= 0)
                     break;
+                //signaled by _gs_wait_for_slot_mode when the payload has been written
+                vosSemWaitTimeout(gs.bufmode, TIME_U(ss, MILLIS));
             }
             gs.mode = GS_MODE_NORMAL;
 
         } else {
             //standby here!
             printf("Entering buffer mode\n");
-            vosSemWait(gs.bufmode);
+            //stale signals (e.g. from an expired prompt mode) must not resume the loop early
+            //in transparent mode the loop sleeps here until the escape sequence is sent
+            while (gs.mode == GS_MODE_BUFFER || gs.mode == GS_MODE_TRANSPARENT)
+                vosSemWait(gs.bufmode);
             printf("Exited buffer mode\n");
         }
     }
@@ -1295,6 +1663,55 @@ void _gs_loop(void* args)
  *
  */
 
+/**
+ * @brief Claim a free entry of the socket buffer pool
+ *
+ * @param[in] id    the socket id
+ *
+ * @return 0 on success, -1 if the pool is exhausted
+ */
+int _gs_socket_claim_buffers(int id)
+{
+    GSocket* sock = &gs_sockets[id];
+    int i, res = -1;
+
+    vosSemWait(gs.ringlock);
+    for (i = 0; i < GS_SOCK_POOL; i++) {
+        if (!(gs_poolused & (1 << i))) {
+            gs_poolused |= (1 << i);
+            sock->rxbuf = gs_rxpool[i];
+            sock->txbuf = gs_txpool[i];
+            res = 0;
+            break;
+        }
+    }
+    vosSemSignal(gs.ringlock);
+    return res;
+}
+
+/**
+ * @brief Give the buffers of a socket back to the pool
+ *
+ * Must be called after the socket has been closed in the module: no more data can be pushed in its ring.
+ *
+ * @param[in] id    the socket id
+ */
+void _gs_socket_release_buffers(int id)
+{
+    GSocket* sock = &gs_sockets[id];
+    int i;
+
+    vosSemWait(gs.ringlock);
+    if (sock->rxbuf) {
+        i = (sock->rxbuf - gs_rxpool[0]) / MAX_SOCK_RX_BUF;
+        gs_poolused &= ~(1 << i);
+        sock->rxbuf = NULL;
+        sock->txbuf = NULL;
+        sock->len = 0;
+    }
+    vosSemSignal(gs.ringlock);
+}
+
 /**
  * @brief creates a new socket with proto
  *
@@ -1324,15 +1741,36 @@ int _gs_socket_new(int proto, int secure)
             if (sock->to_be_closed) {
                 _gs_socket_close(i);
             }
+            if (_gs_socket_claim_buffers(i)) {
+                printf("can't open socket, no free buffers\n");
+                break;
+            }
             sock->acquired = 1;
             sock->to_be_closed = 0;
             sock->connected = 0;
             sock->timeout = 0;
+            sock->sndtimeout = 0;
             sock->bound = 0;
+            sock->push = 0;
+            sock->transparent = 0;
+            sock->prefetch = 0;
+            sock->rxmore = 0;
+            sock->nodelay = 1;
+            sock->nonblock = 0;
+            sock->sslctx = -1;
+            sock->txlen = 0;
+            sock->txerr = 0;
+            sock->unacked = 0;
+            sock->unackedtime = 0;
+            sock->txwin = GS_TX_WINDOW;
+            sock->txcwnd = GS_TX_WINDOW;
+            sock->txfull = 0;
+            _gs_socket_rxready(i, 0);
             sock->secure = secure;
             sock->proto = proto;
             sock->head = 0;
             sock->len = 0;
+            sock->rxsize = MAX_SOCK_RX_BUF;
             res = i;
             // vosSemSignal(sock->lock);
             break;
@@ -1377,801 +1815,2831 @@ int _gs_file_upload(uint8_t* filename, int namelen, uint8_t* content, int len)
     return res;
 }
 
-uint8_t f_cacert[16] = "RAM:cacert#.pem";
-uint8_t f_clicert[16] = "RAM:clicrt#.pem";
-uint8_t f_prvkey[16] = "RAM:prvkey#.pem";
-
-int _gs_ssl_cfg(int op, int ctx, int val)
+/**
+ * @brief FNV-1a hash of a buffer
+ */
+uint32_t _gs_file_hash(uint8_t* content, int len)
 {
-    GSSlot* slot;
-    int res = 0;
-
-    //WARNING: names of certificates are global!
-
-    slot = _gs_acquire_slot(GS_CMD_QSSLCFG, NULL, 0, GS_TIMEOUT * 5, 0);
-    switch (op) {
-    case 0:
-        _gs_send_at(GS_CMD_QSSLCFG, "=\"s\",i,i", "sslversion", 10, ctx, val); //select TLS 1.2 only
-        break;
-    case 1:
-        _gs_send_at(GS_CMD_QSSLCFG, "=\"s\",i,\"0XFFFF\"", "ciphersuite", 11, ctx); //select all secure ciphersuites
-        break;
-    case 2:
-        _gs_send_at(GS_CMD_QSSLCFG, "=\"s\",i,\"s\"", "cacert", 6, ctx, f_cacert, 11); //select cacert
-        break;
-    case 3:
-        _gs_send_at(GS_CMD_QSSLCFG, "=\"s\",i,\"s\"", "clientcert", 10, ctx, f_clicert, 11); //select clicert
-        break;
-    case 4:
-        _gs_send_at(GS_CMD_QSSLCFG, "=\"s\",i,\"s\"", "clientkey", 9, ctx, f_prvkey, 11); //select prvkey
-        break;
-    case 5:
-        _gs_send_at(GS_CMD_QSSLCFG, "=\"s\",i,i", "seclevel", 8, ctx, val); //select prvkey
-        break;
-    case 6:
-        _gs_send_at(GS_CMD_QSSLCFG, "=\"s\",i,i", "ignorelocaltime", 15, ctx, val); //select date check
-        break;
-    case 7:
-        _gs_send_at(GS_CMD_QSSLCFG, "=\"s\",i,i", "negotiatetime", 13, ctx, val); //select timeout
-        break;
+    uint32_t hash = 2166136261u;
+    while (len-- > 0) {
+        hash ^= *content++;
+        hash *= 16777619u;
     }
-    _gs_wait_for_slot();
-    res = slot->err;
-    _gs_release_slot(slot);
-    return res;
+    return hash;
 }
 
-int _gs_socket_tls(int id, uint8_t* cacert, int cacertlen, uint8_t* clicert, int clicertlen, uint8_t* pvkey, int pvkeylen, int authmode)
+/**
+ * @brief Find the digest entry of a file. gs.fslock must be held
+ *
+ * @return the entry or NULL if the file is not in the cache
+ */
+GSFileDigest* _gs_file_digest(uint8_t* filename, int namelen)
 {
-    GSocket* sock;
-    GSSlot* slot;
-    int res = 0;
-    int ctx = id;
-    sock = &gs_sockets[id];
-
-    //SSL CTX = socket id
-    //let's upload files..
-
-    vosSemWait(sock->lock);
-
-    res += _gs_ssl_cfg(0, ctx, 3); //TLS 1.2
-    res += _gs_ssl_cfg(1, ctx, 0); //all ciphers
-
-    if (cacert && cacertlen) {
-        f_cacert[10] = '0' + id;
-        _gs_file_delete(f_cacert, 11);
-        res += _gs_file_upload(f_cacert, 11, cacert, cacertlen);
-        res += _gs_ssl_cfg(2, ctx, 0);
-    }
-    if (clicert && clicertlen) {
-        f_clicert[10] = '0' + id;
-        _gs_file_delete(f_clicert, 11);
-        res += _gs_file_upload(f_clicert, 11, clicert, clicertlen);
-        res += _gs_ssl_cfg(3, ctx, 0);
-    }
-    if (pvkey && pvkeylen) {
-        f_prvkey[10] = '0' + id;
-        _gs_file_delete(f_prvkey, 11);
-        res += _gs_file_upload(f_prvkey, 11, pvkey, pvkeylen);
-        res += _gs_ssl_cfg(4, ctx, 0);
+    int i;
+    for (i = 0; i < MAX_FILE_DIGESTS; i++) {
+        if (gs_fdigests[i].namelen == namelen && memcmp(gs_fdigests[i].name, filename, namelen) == 0)
+            return &gs_fdigests[i];
     }
-
-    res += _gs_ssl_cfg(5, ctx, authmode); //0 none, 1 server, 2 server+client
-    res += _gs_ssl_cfg(6, ctx, 1);        //ignore time check
-    vosSemSignal(sock->lock);
-
-    return res;
+    return NULL;
 }
 
-int _gs_socket_opened(int id, int success)
+/**
+ * @brief Forget all file digests
+ *
+ * To be called when the module restarts: RAM files are lost.
+ */
+void _gs_file_digest_clear(void)
 {
-    GSocket* sock;
-    sock = &gs_sockets[id];
-    if (success)
-        sock->connected = 1;
-    else
-        sock->connected = 2;
-    return 0;
+    vosSemWait(gs.fslock);
+    memset(gs_fdigests, 0, sizeof(gs_fdigests));
+    gs_fdigestnext = 0;
+    gs_certscanned = 0;
+    vosSemSignal(gs.fslock);
 }
 
-int _gs_socket_bind(int id, struct sockaddr_in* addr)
+/**
+ * @brief Make sure a file in the module has the given content
+ *
+ * The file is deleted and uploaded again only if its content differs (by length and FNV-1a digest)
+ * from the last one uploaded by the driver.
+ *
+ * @param[in] filename  the file name (with the RAM: or UFS: prefix)
+ * @param[in] namelen   its length
+ * @param[in] content   the content
+ * @param[in] len       its length
+ *
+ * @return 0 on success
+ */
+int _gs_file_sync(uint8_t* filename, int namelen, uint8_t* content, int len)
 {
+    GSFileDigest* fd;
+    uint32_t hash;
     int res = 0;
-    int timeout = 160000; //150s timeout for URC
-    GSocket* sock;
-    GSSlot* slot;
-    sock = &gs_sockets[id];
-    if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
-        printf("can't bind socket, no network\n");
+
+    if (namelen > MAX_FILE_NAME)
         return -1;
+    hash = _gs_file_hash(content, len);
+    vosSemWait(gs.fslock);
+    fd = _gs_file_digest(filename, namelen);
+    if (fd && fd->len == len && fd->hash == hash) {
+        printf("file unchanged, skip upload\n");
+    } else {
+        if (fd) {
+            //invalid until the upload succeeds
+            fd->namelen = 0;
+        }
+        _gs_file_delete(filename, namelen);
+        res = _gs_file_upload(filename, namelen, content, len);
+        if (!res) {
+            if (!fd) {
+                fd = &gs_fdigests[gs_fdigestnext];
+                gs_fdigestnext = (gs_fdigestnext + 1) % MAX_FILE_DIGESTS;
+            }
+            memcpy(fd->name, filename, namelen);
+            fd->namelen = namelen;
+            fd->len = len;
+            fd->hash = hash;
+        }
     }
+    vosSemSignal(gs.fslock);
+    return res;
+}
 
-    vosSemWait(sock->lock);
+static const uint32_t gs_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
 
-    slot = _gs_acquire_slot(GS_CMD_QIOPEN, NULL, 0, GS_TIMEOUT * 60 * 3, 0);
-    if (sock->proto == 17) {
-        //addr is ignored, we can only bind to 127.0.0.1
-        _gs_send_at(GS_CMD_QIOPEN, "=i,i,\"UDP SERVICE\",\"127.0.0.1\",0,i,0", GS_PROFILE, id, OAL_GET_NETPORT(addr->sin_port));
-    }
-    _gs_wait_for_slot();
-    if (slot->err) {
-        res = -1;
-    }
-    _gs_release_slot(slot);
+#define GS_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
 
-    vosSemSignal(sock->lock);
-    if (res == -1) {
-        return res;
+/**
+ * @brief Process one 64 bytes block of SHA-256
+ *
+ * The message schedule is kept in a 16 words window to save stack.
+ */
+void _gs_sha256_block(uint32_t* h, const uint8_t* p)
+{
+    uint32_t w[16], v[8], s0, s1, t1, t2;
+    int i, j;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) | ((uint32_t)p[4 * i + 2] << 8) | p[4 * i + 3];
+    memcpy(v, h, sizeof(v));
+    for (i = 0; i < 64; i++) {
+        j = i & 15;
+        if (i >= 16) {
+            s0 = w[(i - 15) & 15];
+            s0 = GS_ROR(s0, 7) ^ GS_ROR(s0, 18) ^ (s0 >> 3);
+            s1 = w[(i - 2) & 15];
+            s1 = GS_ROR(s1, 17) ^ GS_ROR(s1, 19) ^ (s1 >> 10);
+            w[j] += s0 + s1 + w[(i - 7) & 15];
+        }
+        t1 = v[7] + (GS_ROR(v[4], 6) ^ GS_ROR(v[4], 11) ^ GS_ROR(v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) + gs_sha256_k[i] + w[j];
+        t2 = (GS_ROR(v[0], 2) ^ GS_ROR(v[0], 13) ^ GS_ROR(v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
     }
+    for (i = 0; i < 8; i++)
+        h[i] += v[i];
+}
 
-    res = -1;
+/**
+ * @brief SHA-256 of a buffer
+ *
+ * @param[in]  content  the data
+ * @param[in]  len      its length
+ * @param[out] digest   the 32 bytes digest
+ */
+void _gs_sha256(const uint8_t* content, int len, uint8_t* digest)
+{
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    uint8_t block[64];
+    uint32_t bits = (uint32_t)len << 3;
+    int i;
 
-    while (timeout > 0) {
-        vosThSleep(TIME_U(100, MILLIS));
-        timeout -= 100;
-        vosSemWait(sock->lock);
-        if (sock->connected) {
-            if (sock->connected == 2) {
-                res = -2;
-            } else {
-                res = 0;
-            }
-        }
-        vosSemSignal(sock->lock);
-        if (!res || res == -2)
-            break;
+    for (; len >= 64; len -= 64, content += 64)
+        _gs_sha256_block(h, content);
+    memset(block, 0, sizeof(block));
+    memcpy(block, content, len);
+    block[len] = 0x80;
+    if (len >= 56) {
+        _gs_sha256_block(h, block);
+        memset(block, 0, sizeof(block));
     }
+    for (i = 0; i < 4; i++)
+        block[63 - i] = bits >> (8 * i);
+    _gs_sha256_block(h, block);
+    for (i = 0; i < 32; i++)
+        digest[i] = h[i >> 2] >> (24 - 8 * (i & 3));
+}
+/**
+ * @brief Check whether a certificate argument is a store name (as returned by _gs_cert_store) instead of PEM content
+ *
+ * @return 1 if it is a store name
+ */
+int _gs_cert_is_name(uint8_t* content, int len)
+{
+    int i;
 
-    if (res) {
-        //oops, timeout or error
-        vosSemWait(sock->lock);
-        // close to allow retrying a new connect on the same sock
-        _gs_do_close(id);
-        sock->bound = 0;
-        vosSemSignal(sock->lock);
-    } else {
-        sock->bound = 1;
+    if (!content || len != GS_CERT_NAME_LEN || memcmp(content, "UFS:", 4) || memcmp(content + GS_CERT_NAME_LEN - 4, ".pem", 4))
+        return 0;
+    for (i = 4; i < GS_CERT_NAME_LEN - 4; i++) {
+        if (!((content[i] >= '0' && content[i] <= '9') || (content[i] >= 'a' && content[i] <= 'f')))
+            return 0;
     }
-    return res;
+    return 1;
 }
 
-int _gs_socket_connect(int id, struct sockaddr_in *addr){
-    uint8_t saddr[16];
-    uint32_t saddrlen;
-    int res = 0;
-    int timeout = 160000; //150s timeout for URC
-    GSocket* sock;
-    GSSlot* slot;
-
-    if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
-        printf("can't connect socket, no network\n");
-        return -1;
-    }
+/**
+ * @brief Digest identifying a certificate
+ *
+ * The digest of a store name is read back from the name, so that a certificate given by name
+ * and by content is the same certificate.
+ *
+ * @param[in]  content  the certificate, or its store name (can be NULL)
+ * @param[in]  len      its length
+ * @param[out] digest   GS_CERT_DIGEST_LEN bytes, all zero if there is no certificate
+ */
+void _gs_cert_digest(uint8_t* content, int len, uint8_t* digest)
+{
+    uint8_t sha[32];
+    int i, c;
 
-    saddrlen = zs_addr_to_string(addr, saddr);
-    sock = &gs_sockets[id];
-    vosSemWait(sock->lock);
-    if (sock->secure) {
-        slot = _gs_acquire_slot(GS_CMD_QSSLOPEN, NULL, 0, GS_TIMEOUT * 60 * 3, 0);
-        if (sock->proto == 6) {
-            _gs_send_at(GS_CMD_QSSLOPEN, "=i,i,i,\"s\",i", GS_PROFILE, id, id, saddr, saddrlen, OAL_GET_NETPORT(addr->sin_port));
-        }
-        //NO DTLS!!
-        // else {
-        //     _gs_send_at(GS_CMD_QIOPEN,"=i,i,i,\"UDP\",\"s\",i",GS_PROFILE,id,saddr,saddrlen,OAL_GET_NETPORT(addr->port));
-        // }
-    } else {
-        slot = _gs_acquire_slot(GS_CMD_QIOPEN, NULL, 0, GS_TIMEOUT * 60 * 3, 0);
-        if (sock->proto == 6) {
-            _gs_send_at(GS_CMD_QIOPEN, "=i,i,\"TCP\",\"s\",i,0,0", GS_PROFILE, id, saddr, saddrlen, OAL_GET_NETPORT(addr->sin_port));
-        } else {
-            //udp
-            _gs_send_at(GS_CMD_QIOPEN, "=i,i,\"UDP\",\"s\",i,0,0", GS_PROFILE, id, saddr, saddrlen, OAL_GET_NETPORT(addr->sin_port));
+    memset(digest, 0, GS_CERT_DIGEST_LEN);
+    if (!content || !len)
+        return;
+    if (_gs_cert_is_name(content, len)) {
+        for (i = 0; i < 2 * GS_CERT_DIGEST_LEN; i++) {
+            c = content[4 + i];
+            c = (c <= '9') ? c - '0' : c - 'a' + 10;
+            digest[i >> 1] |= (i & 1) ? c : c << 4;
         }
+        return;
     }
-    _gs_wait_for_slot();
-    if (slot->err) {
-        res = -1;
-    }
-    _gs_release_slot(slot);
+    _gs_sha256(content, len, sha);
+    memcpy(digest, sha, GS_CERT_DIGEST_LEN);
+}
 
-    vosSemSignal(sock->lock);
-    if (res == -1) {
-        return res;
+/**
+ * @brief Build the certificate store name of a digest
+ *
+ * @param[out] fname    where to store the name (GS_CERT_NAME_LEN bytes)
+ * @param[in]  digest   the certificate digest (see _gs_cert_digest)
+ *
+ * @return the name length
+ */
+int _gs_cert_name(uint8_t* fname, uint8_t* digest)
+{
+    int i;
+
+    memcpy(fname, "UFS:", 4);
+    for (i = 0; i < GS_CERT_DIGEST_LEN; i++) {
+        fname[4 + 2 * i] = "0123456789abcdef"[digest[i] >> 4];
+        fname[5 + 2 * i] = "0123456789abcdef"[digest[i] & 0xf];
     }
+    memcpy(fname + GS_CERT_NAME_LEN - 4, ".pem", 4);
+    return GS_CERT_NAME_LEN;
+}
 
-    res = -1;
+/**
+ * @brief Store a certificate in the module flash
+ *
+ * The name is the SHA-256 of the content, therefore a file of the store with the same name
+ * and length (uploaded before or found by _gs_cert_scan) holds the same certificate and is not
+ * uploaded again. The store is listed on first use after each module start.
+ *
+ * @param[out] fname    the file name (GS_CERT_NAME_LEN bytes)
+ * @param[in]  content  the certificate
+ * @param[in]  len      its length
+ *
+ * @return the name length, or -1 on failure
+ */
+int _gs_cert_store(uint8_t* fname, uint8_t* content, int len)
+{
+    GSFileDigest* fd;
+    uint8_t digest[GS_CERT_DIGEST_LEN];
+    int known;
+
+    if (_gs_cert_is_name(content, len)) {
+        //already a store name
+        memcpy(fname, content, GS_CERT_NAME_LEN);
+        return GS_CERT_NAME_LEN;
+    }
+    _gs_cert_digest(content, len, digest);
+    _gs_cert_name(fname, digest);
+    if (!gs_certscanned)
+        _gs_cert_scan();
+    vosSemWait(gs.fslock);
+    fd = _gs_file_digest(fname, GS_CERT_NAME_LEN);
+    known = (fd && fd->len == len);
+    vosSemSignal(gs.fslock);
+    if (known) {
+        printf("cert in store, skip upload\n");
+    } else if (_gs_file_sync(fname, GS_CERT_NAME_LEN, content, len)) {
+        return -1;
+    }
+    return GS_CERT_NAME_LEN;
+}
 
-    while (timeout > 0) {
-        vosThSleep(TIME_U(100, MILLIS));
-        timeout -= 100;
-        vosSemWait(sock->lock);
-        if (sock->connected) {
-            if (sock->connected == 2) {
-                res = -2;
-            } else {
-                res = 0;
+/**
+ * @brief Remove a certificate from the module flash
+ *
+ * The ssl contexts configured with it are invalidated: they would fail the next handshake.
+ * Sockets already connected are not affected.
+ *
+ * @param[in] content   the certificate, or its store name
+ * @param[in] len       its length
+ *
+ * @return 0 on success
+ */
+int _gs_cert_delete(uint8_t* content, int len)
+{
+    GSFileDigest* fd;
+    uint8_t fname[GS_CERT_NAME_LEN];
+    uint8_t digest[GS_CERT_DIGEST_LEN];
+    int res, ctx, i;
+
+    _gs_cert_digest(content, len, digest);
+    _gs_cert_name(fname, digest);
+    //ssllock before fslock, as in _gs_ssl_ctx_new
+    vosSemWait(gs.ssllock);
+    for (ctx = 0; ctx < GS_SSL_CTXS; ctx++) {
+        for (i = 0; i < 3; i++) {
+            if (gs_sslctx[ctx].configured && !memcmp(gs_sslctx[ctx].digest[i], digest, GS_CERT_DIGEST_LEN)) {
+                printf("ssl context %i invalidated\n", ctx);
+                gs_sslctx[ctx].configured = 0;
             }
         }
-        vosSemSignal(sock->lock);
-        if (!res || res == -2)
-            break;
-    }
-
-    if (res) {
-        _gs_socket_close(id);
-        // vosSemWait(sock->lock);
-        // if connection failed, close to allow retrying a new connect on the same sock
-        // _gs_do_close(id);
-        // sock->connected = 0;
-        // vosSemSignal(sock->lock);
     }
+    vosSemSignal(gs.ssllock);
+
+    vosSemWait(gs.fslock);
+    fd = _gs_file_digest(fname, GS_CERT_NAME_LEN);
+    if (fd)
+        fd->namelen = 0;
+    res = _gs_file_delete(fname, GS_CERT_NAME_LEN);
+    vosSemSignal(gs.fslock);
     return res;
 }
 
 /**
- * @brief retrieve the socket with a specific id if it exists
+ * @brief Record a file of the certificate store reported by QFLST
  *
- * @param[in] id    the socket id
+ * Called by the main thread for each +QFLST line, while the thread running _gs_cert_scan holds gs.fslock.
+ * Only the name (the SHA-256 of the content) and the reported size are recorded: _gs_cert_store
+ * trusts a file only if both match.
  *
- * @return the socket or NULL on failure
+ * @param[in] resp  the QFLST parameters
+ * @param[in] eresp their end
  */
-GSocket* _gs_socket_get(int id)
+void _gs_cert_listed(uint8_t* resp, uint8_t* eresp)
 {
-    GSocket *sock, *res = NULL;
-
-    sock = &gs_sockets[id];
-    vosSemWait(sock->lock);
-
-    if (sock->acquired)
-        res = sock;
+    GSFileDigest* fd;
+    uint8_t* name;
+    int namelen, size;
 
-    vosSemSignal(sock->lock);
-    return res;
+    if (_gs_parse_command_arguments(resp, eresp, "si", &name, &namelen, &size) != 2)
+        return;
+    //strip quotes
+    name++;
+    namelen -= 2;
+    if (!_gs_cert_is_name(name, namelen))
+        return;
+    fd = _gs_file_digest(name, namelen);
+    if (!fd) {
+        fd = &gs_fdigests[gs_fdigestnext];
+        gs_fdigestnext = (gs_fdigestnext + 1) % MAX_FILE_DIGESTS;
+    }
+    memcpy(fd->name, name, namelen);
+    fd->namelen = namelen;
+    fd->len = size;
+    //content digest unknown: _gs_file_sync uploads again if asked to
+    fd->hash = 0;
+    printf("cert in store %i\n", size);
 }
 
 /**
- * @brief Send command to close the socket (use internally)
+ * @brief List the certificate store with a single QFLST
  *
- * @param id index of the socket
+ * Certificates found are not uploaded again by _gs_cert_store.
+ *
+ * @return 0 on success
  */
-int _gs_do_close(int id)
+int _gs_cert_scan(void)
 {
-    GSocket* sock;
     GSSlot* slot;
-    int res = 0;
-    sock = &gs_sockets[id];
+    int res;
 
-    if (sock->secure) {
-        slot = _gs_acquire_slot(GS_CMD_QSSLCLOSE, NULL, 0, GS_TIMEOUT * 15, 0);
-        _gs_send_at(GS_CMD_QSSLCLOSE, "=i,10", id);
-    } else {
-        slot = _gs_acquire_slot(GS_CMD_QICLOSE, NULL, 0, GS_TIMEOUT * 15, 0);
-        _gs_send_at(GS_CMD_QICLOSE, "=i,10", id);
-    }
+    vosSemWait(gs.fslock);
+    slot = _gs_acquire_slot(GS_CMD_QFLST, NULL, 64, GS_TIMEOUT * 5, 1);
+    _gs_send_at(GS_CMD_QFLST, "=\"s\"", "UFS:*.pem", 9);
     _gs_wait_for_slot();
-    if (slot->err) {
-        res = -1;
-    }
+    res = slot->err;
     _gs_release_slot(slot);
+    //an empty store answers ERROR (no file found): nothing to record
+    gs_certscanned = 1;
+    vosSemSignal(gs.fslock);
+    return res;
+}
 
-    if (res == 0) {
-        sock->connected = 0;
-        sock->bound = 0;
-    }
+//certificate file names: # is replaced by the ssl context id
+const uint8_t f_cacert[16] = "RAM:cacert#.pem";
+const uint8_t f_clicert[16] = "RAM:clicrt#.pem";
+const uint8_t f_prvkey[16] = "RAM:prvkey#.pem";
 
-    return res;
+/**
+ * @brief Build the name of a certificate file of an ssl context
+ *
+ * @param[out] fname    where to store the name (16 bytes)
+ * @param[in]  tpl      one of f_cacert, f_clicert, f_prvkey
+ * @param[in]  ctx      the ssl context
+ *
+ * @return the name length
+ */
+int _gs_ssl_file(uint8_t* fname, const uint8_t* tpl, int ctx)
+{
+    memcpy(fname, tpl, 16);
+    fname[10] = '0' + ctx;
+    return 11;
 }
 
-int _gs_socket_close_nolock(int id){
-    GSocket* sock = &gs_sockets[id];
-    //if not acquired, ignore
-    if (!sock->acquired) return 0;
-    int res = _gs_do_close(id);
-    //regardless of the error (already closed), release this socket index
-    sock->acquired = 0;
-    //unlock sockets waiting on rx
-    vosSemSignal(sock->rx);
-    return res;
+/**
+ * @brief Get the certificate file of an ssl context in the module
+ *
+ * With GS_CERT_STORE the certificate goes in the flash store (shared by all contexts),
+ * otherwise in a RAM file of the context. Private keys are never written to flash.
+ * A store name given instead of the content is used as is.
+ *
+ * @param[out] fname    the file name (MAX_FILE_NAME bytes)
+ * @param[in]  tpl      RAM file name template: one of f_cacert, f_clicert, f_prvkey
+ * @param[in]  ctx      the ssl context
+ * @param[in]  content  the certificate
+ * @param[in]  len      its length
+ *
+ * @return the name length or -1 on failure
+ */
+int _gs_ssl_cert_file(uint8_t* fname, const uint8_t* tpl, int ctx, uint8_t* content, int len)
+{
+    int namelen;
+#if GS_CERT_STORE
+    if (tpl != f_prvkey)
+        return _gs_cert_store(fname, content, len);
+#endif
+    if (_gs_cert_is_name(content, len))
+        return _gs_cert_store(fname, content, len);
+    namelen = _gs_ssl_file(fname, tpl, ctx);
+    if (_gs_file_sync(fname, namelen, content, len))
+        return -1;
+    return namelen;
 }
 
+//QSSLCFG settings, indexed by op
+const char* const gs_sslcfg_names[] = {
+    "sslversion",       //0: protocol version
+    "ciphersuite",      //1: always all secure ciphersuites
+    "cacert",           //2: file of the CA certificate
+    "clientcert",       //3: file of the client certificate
+    "clientkey",        //4: file of the client private key
+    "seclevel",         //5: 0 none, 1 server, 2 server+client
+    "ignorelocaltime",  //6: date check
+    "negotiatetime"     //7: handshake timeout
+};
+
 /**
- * @brief Close socket and release resources
+ * @brief Format the parameters of one QSSLCFG setting
  *
- * Even after a socket connection has been closed remotely, call this function
- * to free the allocated socket resource.
+ * @param[out] buf      where to store them (GS_SSL_CFG_PARAM bytes)
+ * @param[in]  op       the setting (index of gs_sslcfg_names)
+ * @param[in]  ctx      the ssl context
+ * @param[in]  val      the value of numeric settings
+ * @param[in]  fname    the file of certificate settings
+ * @param[in]  fnamelen its length
  *
- * @param id index of the socket
+ * @return the parameters length, -1 if they don't fit buf
  */
-int _gs_socket_close(int id)
+int _gs_ssl_cfg_param(uint8_t* buf, int op, int ctx, int val, uint8_t* fname, int fnamelen)
 {
-    GSocket* sock;
-    // GSSlot *slot;
-    int res = 0;
-    sock = &gs_sockets[id];
+    const char* name = gs_sslcfg_names[op];
+    int len = 0;
 
-    vosSemWait(sock->lock);
-    /*res =*/ _gs_socket_close_nolock(id);
-    vosSemSignal(sock->lock);
-    return res;
+    //="<name>",<ctx>, followed by at most a quoted file name or a 32 bit integer
+    if (strlen(name) + fnamelen + 19 > GS_SSL_CFG_PARAM) {
+        printf("QSSLCFG %s too long\n", name);
+        return -1;
+    }
+    buf[len++] = '=';
+    buf[len++] = '"';
+    while (*name)
+        buf[len++] = *name++;
+    buf[len++] = '"';
+    buf[len++] = ',';
+    len += modp_itoa10(ctx, buf + len);
+    buf[len++] = ',';
+    if (op == 1) {
+        memcpy(buf + len, "\"0XFFFF\"", 8);
+        len += 8;
+    } else if (op >= 2 && op <= 4) {
+        buf[len++] = '"';
+        memcpy(buf + len, fname, fnamelen);
+        len += fnamelen;
+        buf[len++] = '"';
+    } else {
+        len += modp_itoa10(val, buf + len);
+    }
+    return len;
 }
 
-void _gs_socket_close_all(void)
+/**
+ * @brief Send one QSSLCFG setting
+ *
+ * @param[in] op        the setting (index of gs_sslcfg_names)
+ * @param[in] ctx       the ssl context
+ * @param[in] val       the value of numeric settings
+ * @param[in] fname     the file of certificate settings
+ * @param[in] fnamelen  its length
+ *
+ * @return 0 on success
+ */
+int _gs_ssl_cfg(int op, int ctx, int val, uint8_t* fname, int fnamelen)
 {
-    GSocket* sock;
-    // GSSlot *slot;
-    int id;
+    GSSlot* slot;
+    uint8_t param[GS_SSL_CFG_PARAM];
+    int len, res = 0;
 
-    printf("Closing all sockets...\n");
-    for (id = 0; id < MAX_SOCKS; id++) {
-        sock = &gs_sockets[id];
-        if (sock->acquired) {
-            _gs_socket_closing(id);
-        }
-    }
+    len = _gs_ssl_cfg_param(param, op, ctx, val, fname, fnamelen);
+    if (len < 0)
+        return -1;
+    slot = _gs_acquire_slot(GS_CMD_QSSLCFG, NULL, 0, GS_TIMEOUT * 5, 0);
+    _gs_send_at(GS_CMD_QSSLCFG, "s", param, len);
+    _gs_wait_for_slot();
+    res = slot->err;
+    _gs_release_slot(slot);
+    return res;
 }
 
-int _gs_socket_send(int id, uint8_t* buf, int len)
+/**
+ * @brief Send the QSSLCFG settings collected in a batch with a single AT command
+ *
+ * @param[in] b the batch
+ *
+ * @return 0 if all the settings sent so far were accepted
+ */
+int _gs_ssl_cfg_flush(GSSslCfgBatch* b)
 {
-    int res = len;
     GSSlot* slot;
-    GSocket* sock;
-    sock = &gs_sockets[id];
 
-    vosSemWait(sock->lock);
-    CHECK_SOCKET_OPEN(sock);
-    if (sock->to_be_closed) {
-        // _gs_socket_close_nolock(id);
-        res = -1;
-    } else {
-        if (sock->secure) {
-            slot = _gs_acquire_slot(GS_CMD_QSSLSEND, NULL, 32, GS_TIMEOUT * 10, 0);
-            _gs_send_at(GS_CMD_QSSLSEND, "=i,i", id, len);
-        } else {
-            slot = _gs_acquire_slot(GS_CMD_QISEND, NULL, 32, GS_TIMEOUT * 10, 0);
-            _gs_send_at(GS_CMD_QISEND, "=i,i", id, len);
-        }
-        res = _gs_wait_for_slot_mode(buf, len, NULL, 0);
-        if (res) {
-            //ouch!
-            printf("OUCH %i\n", res);
-        } else {
-            res = len;
-        }
+    if (b->len) {
+        //the module stops at the first failing command and answers ERROR
+        slot = _gs_acquire_slot(GS_CMD_QSSLCFG, NULL, 0, GS_TIMEOUT * 5, 0);
+        _gs_send_at(GS_CMD_QSSLCFG, "s", b->line, b->len);
         _gs_wait_for_slot();
-        if (slot->err) {
-            res = -1;
+        if (slot->err)
+            b->err = -1;
+        _gs_release_slot(slot);
+        b->len = 0;
+    }
+    return b->err;
+}
+
+/**
+ * @brief Add a QSSLCFG setting to a batch
+ *
+ * Settings are joined with ';' in the same command line, which is sent when full.
+ *
+ * @param[in] b         the batch
+ * @param[in] op        the setting (index of gs_sslcfg_names)
+ * @param[in] ctx       the ssl context
+ * @param[in] val       the value of numeric settings
+ * @param[in] fname     the file of certificate settings
+ * @param[in] fnamelen  its length
+ */
+void _gs_ssl_cfg_add(GSSslCfgBatch* b, int op, int ctx, int val, uint8_t* fname, int fnamelen)
+{
+    uint8_t param[GS_SSL_CFG_PARAM];
+    int len;
+
+    len = _gs_ssl_cfg_param(param, op, ctx, val, fname, fnamelen);
+    if (len < 0) {
+        b->err = -1;
+        return;
+    }
+    if (b->len && b->len + 9 + len > GS_SSL_CFG_LINE)
+        _gs_ssl_cfg_flush(b);
+    if (b->len) {
+        memcpy(b->line + b->len, ";+QSSLCFG", 9);
+        b->len += 9;
+    }
+    memcpy(b->line + b->len, param, len);
+    b->len += len;
+}
+
+//batch of the context being configured (protected by gs.ssllock)
+static GSSslCfgBatch gs_sslbatch;
+
+/**
+ * @brief Upload certificates and send the configuration of an ssl context
+ *
+ * Certificates are uploaded first, then all the settings go in as few QSSLCFG command lines as possible.
+ * gs.ssllock must be held.
+ *
+ * @return 0 on success
+ */
+int _gs_ssl_ctx_configure(int ctx, uint8_t* cacert, int cacertlen, uint8_t* clicert, int clicertlen, uint8_t* pvkey, int pvkeylen, int authmode)
+{
+    uint8_t fname[3][MAX_FILE_NAME];
+    int fnamelen[3] = { 0, 0, 0 };
+    GSSslCfgBatch* b = &gs_sslbatch;
+
+    if (cacert && cacertlen) {
+        fnamelen[0] = _gs_ssl_cert_file(fname[0], f_cacert, ctx, cacert, cacertlen);
+    }
+    if (clicert && clicertlen) {
+        fnamelen[1] = _gs_ssl_cert_file(fname[1], f_clicert, ctx, clicert, clicertlen);
+    }
+    if (pvkey && pvkeylen) {
+        fnamelen[2] = _gs_ssl_cert_file(fname[2], f_prvkey, ctx, pvkey, pvkeylen);
+    }
+    if (fnamelen[0] < 0 || fnamelen[1] < 0 || fnamelen[2] < 0)
+        return -1;
+
+    b->len = 0;
+    b->err = 0;
+    _gs_ssl_cfg_add(b, 0, ctx, 3, NULL, 0); //TLS 1.2
+    _gs_ssl_cfg_add(b, 1, ctx, 0, NULL, 0); //all ciphers
+    if (fnamelen[0])
+        _gs_ssl_cfg_add(b, 2, ctx, 0, fname[0], fnamelen[0]);
+    if (fnamelen[1])
+        _gs_ssl_cfg_add(b, 3, ctx, 0, fname[1], fnamelen[1]);
+    if (fnamelen[2])
+        _gs_ssl_cfg_add(b, 4, ctx, 0, fname[2], fnamelen[2]);
+    _gs_ssl_cfg_add(b, 5, ctx, authmode, NULL, 0); //0 none, 1 server, 2 server+client
+    _gs_ssl_cfg_add(b, 6, ctx, 1, NULL, 0);        //ignore time check
+    return _gs_ssl_cfg_flush(b);
+}
+
+/**
+ * @brief Get an ssl context with the given certificates and authmode
+ *
+ * A context of the module already holding the same configuration is shared, otherwise
+ * a free one is configured. The returned context must be given back with _gs_ssl_ctx_release.
+ *
+ * @param[in] cacert        the CA certificate (can be NULL)
+ * @param[in] cacertlen     its length
+ * @param[in] clicert       the client certificate (can be NULL)
+ * @param[in] clicertlen    its length
+ * @param[in] pvkey         the client private key (can be NULL)
+ * @param[in] pvkeylen      its length
+ * @param[in] authmode      0 no verification, 1 server, 2 server and client
+ *
+ * @return the ssl context id or -1 on failure
+ */
+int _gs_ssl_ctx_new(uint8_t* cacert, int cacertlen, uint8_t* clicert, int clicertlen, uint8_t* pvkey, int pvkeylen, int authmode)
+{
+    GSSslCtx* c;
+    uint8_t digest[3][GS_CERT_DIGEST_LEN];
+    int ctx, res = -1;
+
+    _gs_cert_digest(cacert, cacertlen, digest[0]);
+    _gs_cert_digest(clicert, clicertlen, digest[1]);
+    _gs_cert_digest(pvkey, pvkeylen, digest[2]);
+
+    vosSemWait(gs.ssllock);
+    for (ctx = 0; ctx < GS_SSL_CTXS; ctx++) {
+        c = &gs_sslctx[ctx];
+        if (c->configured && c->authmode == authmode && !memcmp(c->digest, digest, sizeof(digest))) {
+            //same configuration already in the module
+            c->refs++;
+            res = ctx;
+            break;
+        }
+    }
+    if (res < 0) {
+        //prefer contexts never configured, keep the others for later reuse
+        for (ctx = 0; ctx < GS_SSL_CTXS; ctx++) {
+            if (!gs_sslctx[ctx].refs && !gs_sslctx[ctx].configured)
+                break;
+        }
+        if (ctx == GS_SSL_CTXS) {
+            for (ctx = 0; ctx < GS_SSL_CTXS; ctx++) {
+                if (!gs_sslctx[ctx].refs)
+                    break;
+            }
+        }
+        if (ctx < GS_SSL_CTXS) {
+            c = &gs_sslctx[ctx];
+            c->configured = 0;
+            if (!_gs_ssl_ctx_configure(ctx, cacert, cacertlen, clicert, clicertlen, pvkey, pvkeylen, authmode)) {
+                c->configured = 1;
+                c->authmode = authmode;
+                memcpy(c->digest, digest, sizeof(digest));
+                c->refs = 1;
+                res = ctx;
+            }
+        } else {
+            printf("no free ssl context\n");
+        }
+    }
+    vosSemSignal(gs.ssllock);
+    return res;
+}
+
+/**
+ * @brief Forget all ssl contexts
+ *
+ * To be called when the module restarts: its ssl configuration is lost.
+ */
+void _gs_ssl_ctx_clear(void)
+{
+    vosSemWait(gs.ssllock);
+    memset(gs_sslctx, 0, sizeof(gs_sslctx));
+    vosSemSignal(gs.ssllock);
+}
+
+/**
+ * @brief Take another reference to a configured ssl context
+ *
+ * @return 0 on success, -1 if the context is not configured
+ */
+int _gs_ssl_ctx_retain(int ctx)
+{
+    int res = -1;
+    if (ctx < 0 || ctx >= GS_SSL_CTXS)
+        return -1;
+    vosSemWait(gs.ssllock);
+    if (gs_sslctx[ctx].configured) {
+        gs_sslctx[ctx].refs++;
+        res = 0;
+    }
+    vosSemSignal(gs.ssllock);
+    return res;
+}
+
+/**
+ * @brief Give back a reference to an ssl context
+ *
+ * The configuration stays in the module: an unreferenced context is reused as is
+ * by the next _gs_ssl_ctx_new with the same certificates.
+ */
+void _gs_ssl_ctx_release(int ctx)
+{
+    if (ctx < 0 || ctx >= GS_SSL_CTXS)
+        return;
+    vosSemWait(gs.ssllock);
+    //never drop the references of the api (a socket may outlive a module restart)
+    if (gs_sslctx[ctx].refs > gs_sslctx[ctx].apirefs)
+        gs_sslctx[ctx].refs--;
+    vosSemSignal(gs.ssllock);
+}
+
+/**
+ * @brief Mark a reference from _gs_ssl_ctx_new as owned by the api
+ *
+ * @return 0 on success, -1 if the context is no longer configured (module restarted meanwhile)
+ */
+int _gs_ssl_ctx_own(int ctx)
+{
+    int res = -1;
+    if (ctx < 0 || ctx >= GS_SSL_CTXS)
+        return -1;
+    vosSemWait(gs.ssllock);
+    if (gs_sslctx[ctx].configured && gs_sslctx[ctx].apirefs < gs_sslctx[ctx].refs) {
+        gs_sslctx[ctx].apirefs++;
+        res = 0;
+    }
+    vosSemSignal(gs.ssllock);
+    return res;
+}
+
+/**
+ * @brief Give back a reference owned by the api
+ *
+ * References held by sockets are not touched: freeing a context more times than
+ * it was returned by the api, or after a module restart, is refused.
+ *
+ * @return 0 on success, -1 if the api holds no reference to the context
+ */
+int _gs_ssl_ctx_free(int ctx)
+{
+    int res = -1;
+    if (ctx < 0 || ctx >= GS_SSL_CTXS)
+        return -1;
+    vosSemWait(gs.ssllock);
+    if (gs_sslctx[ctx].apirefs) {
+        gs_sslctx[ctx].apirefs--;
+        gs_sslctx[ctx].refs--;
+        res = 0;
+    }
+    vosSemSignal(gs.ssllock);
+    return res;
+}
+
+/**
+ * @brief Configure the ssl context of a secure socket
+ *
+ * @return 0 on success
+ */
+int _gs_socket_tls(int id, uint8_t* cacert, int cacertlen, uint8_t* clicert, int clicertlen, uint8_t* pvkey, int pvkeylen, int authmode)
+{
+    GSocket* sock;
+    int ctx;
+    sock = &gs_sockets[id];
+
+    ctx = _gs_ssl_ctx_new(cacert, cacertlen, clicert, clicertlen, pvkey, pvkeylen, authmode);
+    if (ctx < 0)
+        return -1;
+
+    vosSemWait(sock->lock);
+    _gs_ssl_ctx_release(sock->sslctx);
+    sock->sslctx = ctx;
+    vosSemSignal(sock->lock);
+
+    return 0;
+}
+
+int _gs_socket_opened(int id, int success)
+{
+    GSocket* sock;
+    if (id < 0 || id >= MAX_SOCKS)
+        return -1;
+    sock = &gs_sockets[id];
+    if (success)
+        sock->connected = 1;
+    else
+        sock->connected = 2;
+    //wake up the connecting thread
+    vosSemSignal(sock->opened);
+    //connection outcome is reported by select
+    vosSemSignal(gs.selectlock);
+    return 0;
+}
+
+/**
+ * @brief Discard completions left by previous QIOPEN/QSSLOPEN on a socket
+ *
+ * @param[in] id    the socket id
+ */
+void _gs_socket_reset_opened(int id)
+{
+    GSocket* sock;
+    sock = &gs_sockets[id];
+    while (vosSemWaitTimeout(sock->opened, TIME_U(0, MILLIS)) != VRES_TIMEOUT)
+        ;
+}
+
+/**
+ * @brief Wait for the QIOPEN/QSSLOPEN urc of a socket
+ *
+ * @param[in] id        the socket id
+ * @param[in] timeout   max wait in milliseconds
+ *
+ * @return 0 if connected, -2 if the module reported a failure, -1 on timeout
+ */
+int _gs_socket_wait_opened(int id, int timeout)
+{
+    GSocket* sock;
+    int32_t remaining;
+    uint32_t tstart = vosMillis();
+    sock = &gs_sockets[id];
+
+    while (!sock->connected) {
+        remaining = timeout - (int32_t)(vosMillis() - tstart);
+        if (remaining <= 0)
+            break;
+        vosSemWaitTimeout(sock->opened, TIME_U(remaining, MILLIS));
+    }
+    if (sock->connected == 1)
+        return 0;
+    return (sock->connected == 2) ? -2 : -1;
+}
+
+int _gs_socket_bind(int id, struct sockaddr_in* addr)
+{
+    int res = 0;
+    int timeout = 160000; //150s timeout for URC
+    GSocket* sock;
+    GSSlot* slot;
+    sock = &gs_sockets[id];
+    if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
+        printf("can't bind socket, no network\n");
+        return -1;
+    }
+
+    vosSemWait(sock->lock);
+    _gs_socket_reset_opened(id);
+
+    slot = _gs_acquire_slot(GS_CMD_QIOPEN, NULL, 0, GS_TIMEOUT * 60 * 3, 0);
+    if (sock->proto == 17) {
+        //addr is ignored, we can only bind to 127.0.0.1
+        //access mode: 0 buffer, 1 push (SO_UG96_PUSH)
+        _gs_send_at(GS_CMD_QIOPEN, "=i,i,\"UDP SERVICE\",\"127.0.0.1\",0,i,i", GS_PROFILE, id, OAL_GET_NETPORT(addr->sin_port), (sock->push) ? 1 : 0);
+    }
+    _gs_wait_for_slot();
+    if (slot->err) {
+        res = -1;
+    }
+    _gs_release_slot(slot);
+
+    vosSemSignal(sock->lock);
+    if (res == -1) {
+        return res;
+    }
+
+    //signaled by the urc handler
+    res = _gs_socket_wait_opened(id, timeout);
+
+    if (res) {
+        //oops, timeout or error
+        vosSemWait(sock->lock);
+        // close to allow retrying a new connect on the same sock
+        _gs_do_close(id);
+        sock->bound = 0;
+        vosSemSignal(sock->lock);
+    } else {
+        sock->bound = 1;
+    }
+    return res;
+}
+
+/**
+ * @brief Issue QIOPEN/QSSLOPEN for a socket without waiting for the urc
+ *
+ * @param[in] id    the socket id
+ * @param[in] addr  the remote address
+ *
+ * @return -1 on error, ERR_CONN if the socket is not acquired, 0 if the open urc is pending, 1 if already connected (transparent mode)
+ */
+int _gs_socket_start_connect(int id, struct sockaddr_in *addr){
+    uint8_t saddr[16];
+    uint32_t saddrlen;
+    int res = 0;
+    GSocket* sock;
+    GSSlot* slot;
+
+    saddrlen = zs_addr_to_string(addr, saddr);
+    sock = &gs_sockets[id];
+    vosSemWait(sock->lock);
+    if (!sock->acquired) {
+        //closed (or never created): its buffers are gone
+        vosSemSignal(sock->lock);
+        return ERR_CONN;
+    }
+    _gs_socket_reset_opened(id);
+    if (sock->secure && sock->sslctx < 0) {
+        //not configured: no verification
+        sock->sslctx = _gs_ssl_ctx_new(NULL, 0, NULL, 0, NULL, 0, 0);
+        if (sock->sslctx < 0) {
+            vosSemSignal(sock->lock);
+            return -1;
+        }
+    }
+    if (sock->secure) {
+        slot = _gs_acquire_slot(GS_CMD_QSSLOPEN, NULL, 0, GS_TIMEOUT * 60 * 3, 0);
+        if (sock->proto == 6) {
+            _gs_send_at(GS_CMD_QSSLOPEN, "=i,i,i,\"s\",i", GS_PROFILE, sock->sslctx, id, saddr, saddrlen, OAL_GET_NETPORT(addr->sin_port));
+        }
+        //NO DTLS!!
+        // else {
+        //     _gs_send_at(GS_CMD_QIOPEN,"=i,i,i,\"UDP\",\"s\",i",GS_PROFILE,id,saddr,saddrlen,OAL_GET_NETPORT(addr->port));
+        // }
+    } else {
+        slot = _gs_acquire_slot(GS_CMD_QIOPEN, NULL, 0, GS_TIMEOUT * 60 * 3, 0);
+        //access mode: 0 buffer, 1 direct push, 2 transparent
+        if (sock->proto == 6) {
+            _gs_send_at(GS_CMD_QIOPEN, "=i,i,\"TCP\",\"s\",i,0,i", GS_PROFILE, id, saddr, saddrlen, OAL_GET_NETPORT(addr->sin_port), (sock->transparent) ? 2 : sock->push);
+        } else {
+            //udp
+            _gs_send_at(GS_CMD_QIOPEN, "=i,i,\"UDP\",\"s\",i,0,i", GS_PROFILE, id, saddr, saddrlen, OAL_GET_NETPORT(addr->sin_port), sock->push);
+        }
+    }
+    _gs_wait_for_slot();
+    if (slot->err) {
+        res = -1;
+    }
+    if (sock->transparent) {
+        //CONNECT (or an error) is the final answer, no urc follows
+        if (!res && gs.mode == GS_MODE_TRANSPARENT) {
+            sock->connected = 1;
+            gs.transparent = id + 1;
+            //keep gs.slotlock: no AT command can be sent until _gs_exit_transparent_mode
+            _gs_dequeue_slot(slot);
+            res = 1;
+        } else {
+            res = -1;
+            _gs_release_slot(slot);
+        }
+        vosSemSignal(sock->lock);
+        return res;
+    }
+    _gs_release_slot(slot);
+
+    vosSemSignal(sock->lock);
+    return res;
+}
+
+int _gs_socket_connect(int id, struct sockaddr_in *addr){
+    int res = 0;
+    int timeout = 160000; //150s timeout for URC
+    GSocket* sock;
+
+    if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
+        printf("can't connect socket, no network\n");
+        return -1;
+    }
+
+    sock = &gs_sockets[id];
+    res = _gs_socket_start_connect(id, addr);
+    if (res) {
+        //error or transparent connection done
+        return (res > 0) ? 0 : res;
+    }
+    if (sock->nonblock) {
+        //the QIOPEN urc completes the connection: select reports it in writeset (or exceptset on failure)
+        return ERR_INPROGRESS;
+    }
+
+    //signaled by the urc handler
+    res = _gs_socket_wait_opened(id, timeout);
+
+    if (res) {
+        _gs_socket_close(id);
+        // vosSemWait(sock->lock);
+        // if connection failed, close to allow retrying a new connect on the same sock
+        // _gs_do_close(id);
+        // sock->connected = 0;
+        // vosSemSignal(sock->lock);
+    }
+    return res;
+}
+
+/**
+ * @brief Connect several sockets at once
+ *
+ * All QIOPEN/QSSLOPEN are sent back to back and the open urcs are awaited together
+ * against a single deadline, so the connections are established in parallel by the module.
+ * Transparent sockets are refused since they would seize the serial port, and so are
+ * repeated ids (a socket can't be opened twice).
+ *
+ * @param[in]  n        number of sockets
+ * @param[in]  ids      the socket ids
+ * @param[in]  addrs    the remote addresses, one per socket
+ * @param[out] results  per socket outcome: 0 connected, ERR_INPROGRESS for non blocking sockets,
+ *                      ERR_CONN for invalid or repeated sockets, -1 on error, -2 on failure reported by the module
+ *
+ * @return the number of sockets not connected (pending non blocking ones excluded)
+ */
+int _gs_socket_connect_many(int n, int* ids, struct sockaddr_in* addrs, int* results){
+    int i, j, id;
+    int failed = 0;
+    int timeout = 160000; //150s timeout for URC
+    int32_t remaining;
+    uint32_t tstart;
+    GSocket* sock;
+
+    for (i = 0; i < n; i++) {
+        id = ids[i];
+        if (id < 0 || id >= MAX_SOCKS || !gs_sockets[id].acquired || gs_sockets[id].transparent) {
+            results[i] = ERR_CONN;
+            continue;
+        }
+        for (j = 0; j < i; j++) {
+            if (ids[j] == id)
+                break;
+        }
+        if (j < i) {
+            //already in this batch
+            results[i] = ERR_CONN;
+            continue;
+        }
+        if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
+            printf("can't connect socket, no network\n");
+            results[i] = -1;
+            continue;
+        }
+        results[i] = _gs_socket_start_connect(id, &addrs[i]);
+    }
+
+    //all opens are in flight, collect the urcs
+    tstart = vosMillis();
+    for (i = 0; i < n; i++) {
+        if (results[i]) {
+            failed++;
+            continue;
+        }
+        id = ids[i];
+        sock = &gs_sockets[id];
+        if (sock->nonblock) {
+            results[i] = ERR_INPROGRESS;
+            continue;
+        }
+        remaining = timeout - (int32_t)(vosMillis() - tstart);
+        if (remaining < 0)
+            remaining = 0;
+        results[i] = _gs_socket_wait_opened(id, remaining);
+        if (results[i]) {
+            _gs_socket_close(id);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+/**
+ * @brief retrieve the socket with a specific id if it exists
+ *
+ * @param[in] id    the socket id
+ *
+ * @return the socket or NULL on failure
+ */
+GSocket* _gs_socket_get(int id)
+{
+    GSocket *sock, *res = NULL;
+
+    sock = &gs_sockets[id];
+    vosSemWait(sock->lock);
+
+    if (sock->acquired)
+        res = sock;
+
+    vosSemSignal(sock->lock);
+    return res;
+}
+
+/**
+ * @brief Send command to close the socket (use internally)
+ *
+ * @param id index of the socket
+ */
+int _gs_do_close(int id)
+{
+    GSocket* sock;
+    GSSlot* slot;
+    int res = 0;
+    sock = &gs_sockets[id];
+
+    if (sock->secure) {
+        slot = _gs_acquire_slot(GS_CMD_QSSLCLOSE, NULL, 0, GS_TIMEOUT * 15, 0);
+        _gs_send_at(GS_CMD_QSSLCLOSE, "=i,10", id);
+    } else {
+        slot = _gs_acquire_slot(GS_CMD_QICLOSE, NULL, 0, GS_TIMEOUT * 15, 0);
+        _gs_send_at(GS_CMD_QICLOSE, "=i,10", id);
+    }
+    _gs_wait_for_slot();
+    if (slot->err) {
+        res = -1;
+    }
+    _gs_release_slot(slot);
+
+    if (res == 0) {
+        sock->connected = 0;
+        sock->bound = 0;
+    }
+
+    return res;
+}
+
+int _gs_socket_close_nolock(int id){
+    GSocket* sock = &gs_sockets[id];
+    //if not acquired, ignore
+    if (!sock->acquired) return 0;
+    //back to command mode before closing (nothing to do if the carrier was already lost)
+    _gs_exit_transparent_mode(id);
+    if (sock->txlen) {
+        //last chance for buffered data: while the module buffer is full, wait for the peer
+        //to acknowledge and retry, up to the send timeout
+        uint32_t limit = (sock->sndtimeout) ? sock->sndtimeout : KEEPALIVE_PERIOD;
+        uint32_t tstart = vosMillis();
+        uint32_t elapsed;
+        int backoff = GS_TX_BACKOFF_MIN;
+        while (_gs_socket_flush_nolock(id, 0) == 0 && sock->txlen) {
+            elapsed = (uint32_t)(vosMillis() - tstart);
+            if (elapsed >= limit || _gs_socket_wait_window_nolock(id, 0, limit - elapsed) == ERR_CONN)
+                break;
+            vosThSleep(TIME_U(backoff, MILLIS));
+            backoff = MIN(backoff * 2, GS_TX_BACKOFF_MAX);
+        }
+        if (sock->txlen) {
+            //timed out or connection lost: the rest is lost
+            printf("flush incomplete on %i, %i bytes lost\n", id, sock->txlen);
+            sock->txerr = 1;
+            sock->txlen = 0;
+            _gs_worker_flush(id, 0);
+        }
+    }
+    int res = _gs_do_close(id);
+    if (sock->txerr)
+        res = ERR_IF;
+    //regardless of the error (already closed), release this socket index
+    sock->acquired = 0;
+    _gs_socket_release_buffers(id);
+    _gs_ssl_ctx_release(sock->sslctx);
+    sock->sslctx = -1;
+    //unlock sockets waiting on rx
+    vosSemSignal(sock->rx);
+    return res;
+}
+
+/**
+ * @brief Close socket and release resources
+ *
+ * Even after a socket connection has been closed remotely, call this function
+ * to free the allocated socket resource.
+ *
+ * @param id index of the socket
+ */
+int _gs_socket_close(int id)
+{
+    GSocket* sock;
+    // GSSlot *slot;
+    int res = 0;
+    sock = &gs_sockets[id];
+
+    vosSemWait(sock->lock);
+    //errors of an already closed socket are ignored, not the loss of buffered data
+    if (_gs_socket_close_nolock(id) == ERR_IF)
+        res = ERR_IF;
+    vosSemSignal(sock->lock);
+    return res;
+}
+
+void _gs_socket_close_all(void)
+{
+    GSocket* sock;
+    // GSSlot *slot;
+    int id;
+
+    printf("Closing all sockets...\n");
+    for (id = 0; id < MAX_SOCKS; id++) {
+        sock = &gs_sockets[id];
+        if (sock->acquired) {
+            _gs_socket_closing(id);
+        }
+    }
+}
+
+/**
+ * @brief Send buf followed by addbuf with a single QISEND/QSSLSEND
+ *
+ * The socket lock must be held. The total length can't exceed MAX_SOCK_TX_LEN.
+ *
+ * @param[in] id        the socket id
+ * @param[in] buf       the first chunk of data
+ * @param[in] len       its length
+ * @param[in] addbuf    the second chunk of data (can be NULL)
+ * @param[in] addlen    its length
+ * @param[in] nowait    if not 0, don't wait for the serial port
+ *
+ * @return the number of bytes sent, 0 if the module buffer is full, ERR_WOULDBLOCK if the serial port is busy, -1 on error
+ */
+int _gs_socket_write_nolock(int id, uint8_t* buf, int len, uint8_t* addbuf, int addlen, int nowait)
+{
+    int res, cmd;
+    GSSlot* slot;
+    GSocket* sock;
+    sock = &gs_sockets[id];
+
+    cmd = (sock->secure) ? GS_CMD_QSSLSEND : GS_CMD_QISEND;
+    slot = (nowait) ? _gs_try_acquire_slot(cmd, NULL, 32, GS_TIMEOUT * 10, 0) : _gs_acquire_slot(cmd, NULL, 32, GS_TIMEOUT * 10, 0);
+    if (!slot)
+        return ERR_WOULDBLOCK;
+    _gs_send_at(cmd, "=i,i", id, len + addlen);
+    res = _gs_wait_for_slot_mode(buf, len, addbuf, addlen);
+    if (res) {
+        //ouch!
+        printf("OUCH %i\n", res);
+    } else {
+        res = len + addlen;
+    }
+    _gs_wait_for_slot();
+    if (slot->err) {
+        res = -1;
+        _gs_socket_closing(id);
+    } else {
+        //check resp
+        if (memcmp(slot->resp, "SEND FAIL", 9) == 0) {
+            //buffer full! not writable until the next refresh
+            res = 0;
+            //the module is saturated: shrink the window
+            sock->txcwnd = MAX_SOCK_TX_LEN + (sock->txcwnd - MAX_SOCK_TX_LEN) / 2;
+            if (sock->unacked < sock->txcwnd)
+                sock->unacked = sock->txcwnd;
+            sock->txfull = 1;
+        } else if (res > 0) {
+            sock->unacked += res;
+        }
+        //also check network status
+        if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
+            printf("closing socket forcibly from send\n");
+            _gs_socket_closing(id);
+        }
+    }
+    _gs_release_slot(slot);
+    return res;
+}
+
+/**
+ * @brief Send the content of the coalescing buffer
+ *
+ * The socket lock must be held. If the module buffer is full (or the serial port is busy and nowait is set),
+ * data is kept for a later retry. On errors it is dropped and, since the stream is broken, the socket is marked
+ * as closed: the next send and recv return ERR_CLSD, close returns ERR_IF.
+ *
+ * @param[in] id        the socket id
+ * @param[in] nowait    if not 0, don't wait for the serial port
+ *
+ * @return the number of bytes sent, 0 if nothing was sent, ERR_WOULDBLOCK, or -1 on error
+ */
+int _gs_socket_flush_nolock(int id, int nowait)
+{
+    int res = 0;
+    GSocket* sock;
+    sock = &gs_sockets[id];
+
+    if (sock->txlen) {
+        printf("flushing %i on %i\n", sock->txlen, id);
+        res = (sock->to_be_closed) ? -1 : _gs_socket_write_nolock(id, sock->txbuf, sock->txlen, NULL, 0, nowait);
+        if (res && res != ERR_WOULDBLOCK) {
+            if (res < 0) {
+                printf("flush failed on %i, %i bytes lost\n", id, sock->txlen);
+                sock->txerr = 1;
+                _gs_socket_closing(id);
+            }
+            sock->txlen = 0;
+            _gs_worker_flush(id, 0);
+        }
+    }
+    return res;
+}
+
+/**
+ * @brief Take the lock of a socket
+ *
+ * @param[in] sock      the socket
+ * @param[in] nowait    if not 0, don't wait for another thread holding the lock
+ *
+ * @return 0 with the lock taken, ERR_WOULDBLOCK if nowait and the lock is busy
+ */
+int _gs_socket_lock(GSocket* sock, int nowait)
+{
+    if (!nowait) {
+        vosSemWait(sock->lock);
+    } else if (vosSemWaitTimeout(sock->lock, TIME_U(0, MILLIS)) == VRES_TIMEOUT) {
+        return ERR_WOULDBLOCK;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send data on a connected socket
+ *
+ * Small writes on tcp sockets without TCP_NODELAY (opt-in) are collected in the coalescing buffer (see _gs_socket_flush_nolock).
+ *
+ * @param[in] id        the socket id
+ * @param[in] buf       the data
+ * @param[in] len       its length (at most MAX_SOCK_TX_LEN)
+ * @param[in] nowait    if not 0, don't wait for the serial port nor for other threads using the socket
+ *
+ * @return the number of bytes accepted, 0 if the module buffer is full, ERR_WOULDBLOCK, or a negative error
+ */
+int _gs_socket_send(int id, uint8_t* buf, int len, int nowait)
+{
+    int res = len;
+    int r;
+    GSocket* sock;
+    sock = &gs_sockets[id];
+
+    if (_gs_socket_lock(sock, nowait))
+        return ERR_WOULDBLOCK;
+    CHECK_SOCKET_OPEN(sock);
+    if (sock->to_be_closed) {
+        // _gs_socket_close_nolock(id);
+        res = ERR_CLSD;
+    } else if (gs.transparent == id + 1) {
+        res = _gs_transparent_send(id, buf, len);
+    } else if (sock->nodelay || sock->proto != 6) {
+        //no coalescing: datagrams must keep their boundaries
+        res = _gs_socket_write_nolock(id, buf, len, NULL, 0, nowait);
+    } else if (sock->txlen + len <= MAX_SOCK_TX_BUF) {
+        //small write: hold it until the buffer fills or GS_TX_FLUSH_TIME expires
+        memcpy(sock->txbuf + sock->txlen, buf, len);
+        if (!sock->txlen) {
+            sock->txtime = vosMillis();
+            _gs_worker_flush(id, 1);
+        }
+        sock->txlen += len;
+        if (sock->txlen == MAX_SOCK_TX_BUF) {
+            //if the port is busy, the timer flushes it later
+            r = _gs_socket_flush_nolock(id, nowait);
+            if (r < 0 && r != ERR_WOULDBLOCK)
+                res = -1;
+        }
+    } else if (sock->txlen + len <= MAX_SOCK_TX_LEN) {
+        //buffered data and this write in one packet
+        r = _gs_socket_write_nolock(id, sock->txbuf, sock->txlen, buf, len, nowait);
+        if (r > 0) {
+            sock->txlen = 0;
+            _gs_worker_flush(id, 0);
+        } else if (r == 0 || r == ERR_WOULDBLOCK) {
+            //module full or port busy: buffered data is retried later, this write is not accepted
+            res = r;
+        } else {
+            sock->txlen = 0;
+            _gs_worker_flush(id, 0);
+            res = -1;
+        }
+    } else {
+        //keep the order: buffered data first
+        r = _gs_socket_flush_nolock(id, nowait);
+        if (r == ERR_WOULDBLOCK) {
+            res = r;
+        } else if (r < 0 || sock->txlen) {
+            res = (r < 0) ? -1 : 0;
+        } else {
+            res = _gs_socket_write_nolock(id, buf, len, NULL, 0, nowait);
+        }
+    }
+    vosSemSignal(sock->lock);
+
+    return res;
+}
+
+/**
+ * @brief Refresh the unacked bytes count of a tcp socket with QISEND=id,0
+ *
+ * The socket lock must be held.
+ *
+ * @param[in] id        the socket id
+ * @param[in] nowait    if not 0, don't wait for the serial port
+ *
+ * @return the unacked bytes, -1 if the answer can't be parsed, -2 on errors, unexpected answers or busy port
+ */
+int _gs_socket_unacked_nolock(int id, int nowait)
+{
+    int res;
+    GSSlot* slot;
+    GSocket* sock;
+    uint32_t tot;
+    uint32_t ack;
+    uint32_t unack;
+    int cmdlen;
+    sock = &gs_sockets[id];
+
+    slot = (nowait) ? _gs_try_acquire_slot(GS_CMD_QISEND, NULL, 32, GS_TIMEOUT * 10, 1) : _gs_acquire_slot(GS_CMD_QISEND, NULL, 32, GS_TIMEOUT * 10, 1);
+    if (!slot)
+        return -2;
+    _gs_send_at(GS_CMD_QISEND, "=i,0", id);
+    cmdlen = 7;
+    _gs_wait_for_slot();
+    if (!slot->err) {
+        if (memcmp(slot->resp, slot->cmd, cmdlen) == 0) {
+            //resp starts with +QISEND
+            //we need to check this because +QISEND=id,0 answers in a different way
+            //than +QISEND=id,len, so the loop cannot parse args correctly (GS_RES_STR vs GS_RES_STR_OK)
+            slot->resp += 8; //increment resp until after the colon
+            if (_gs_parse_command_arguments(slot->resp, slot->eresp, "iii", &tot, &ack, &unack) != 3) {
+                res = -1;
+            } else {
+                printf("unacked %i %i %i %i\n", id, tot, ack, unack);
+                if (!unack) {
+                    //the window has been drained: grow it and stop throttling
+                    sock->txcwnd = MIN(sock->txwin, sock->txcwnd + MAX_SOCK_TX_LEN);
+                    sock->txfull = 0;
+                }
+                sock->unacked = unack;
+                sock->unackedtime = vosMillis();
+                res = unack;
+            }
+        } else {
+            //bad response
+            res = -2;
+        }
+    } else {
+        //generic error
+        res = -2;
+    }
+    _gs_release_slot(slot);
+    return res;
+}
+
+/**
+ * @brief Check if the tx window of a socket has room for len more bytes
+ *
+ * Must be called with sock->lock held.
+ *
+ * @param[in] id        the socket id
+ * @param[in] len       the bytes about to be sent
+ *
+ * @return 1 if there is room, 0 if not, ERR_CONN if the socket is not usable
+ */
+int _gs_socket_window_room_nolock(int id, int len)
+{
+    GSocket* sock;
+    sock = &gs_sockets[id];
+
+    if (!sock->acquired || sock->connected != 1 || sock->to_be_closed)
+        return ERR_CONN;
+    if (sock->secure || sock->proto != 6 || gs.transparent == id + 1 || !sock->txfull)
+        return 1;
+    //an empty window always accepts a packet
+    return (!sock->unacked || sock->unacked + sock->txlen + len <= sock->txcwnd);
+}
+
+/**
+ * @brief Same as _gs_socket_wait_window, but called with sock->lock held
+ *
+ * The lock is kept while sleeping: only for paths that own the socket anyway (close).
+ */
+int _gs_socket_wait_window_nolock(int id, int len, uint32_t timeout)
+{
+    GSocket* sock;
+    uint32_t tstart = vosMillis();
+    int backoff = GS_TX_BACKOFF_MIN;
+    int room;
+    sock = &gs_sockets[id];
+
+    while (1) {
+        room = _gs_socket_window_room_nolock(id, len);
+        if (room) return (room < 0) ? room : 0;
+        _gs_socket_unacked_nolock(id, 0);
+        sock->unackedtime = vosMillis();
+        room = _gs_socket_window_room_nolock(id, len);
+        if (room) return (room < 0) ? room : 0;
+        if ((uint32_t)(vosMillis() - tstart) >= timeout)
+            return ERR_TIMEOUT;
+        printf("waiting window %i: %i/%i\n", id, sock->unacked, sock->txcwnd);
+        vosThSleep(TIME_U(backoff, MILLIS));
+        backoff = MIN(backoff * 2, GS_TX_BACKOFF_MAX);
+    }
+}
+
+/**
+ * @brief Wait until the tx window of a socket has room for len more bytes
+ *
+ * The window applies only after the module answered SEND FAIL (see _gs_socket_window_room_nolock).
+ * The unacked count is refreshed with QISEND=id,0, sleeping with an exponential backoff
+ * between queries and without holding sock->lock. Sockets that can't be queried
+ * (udp, secure, transparent) never wait.
+ *
+ * @param[in] id        the socket id
+ * @param[in] len       the bytes about to be sent
+ * @param[in] timeout   max wait in milliseconds
+ *
+ * @return 0 when there is room, ERR_TIMEOUT, or ERR_CONN if the socket is not usable (send reports the error)
+ */
+int _gs_socket_wait_window(int id, int len, uint32_t timeout)
+{
+    GSocket* sock;
+    uint32_t tstart = vosMillis();
+    int backoff = GS_TX_BACKOFF_MIN;
+    int room;
+    sock = &gs_sockets[id];
+
+    while (1) {
+        vosSemWait(sock->lock);
+        room = _gs_socket_window_room_nolock(id, len);
+        if (!room) {
+            _gs_socket_unacked_nolock(id, 0);
+            sock->unackedtime = vosMillis();
+            room = _gs_socket_window_room_nolock(id, len);
+        }
+        if (!room)
+            printf("waiting window %i: %i/%i\n", id, sock->unacked, sock->txcwnd);
+        vosSemSignal(sock->lock);
+        if (room)
+            return (room < 0) ? room : 0;
+        if ((uint32_t)(vosMillis() - tstart) >= timeout)
+            return ERR_TIMEOUT;
+        vosThSleep(TIME_U(backoff, MILLIS));
+        backoff = MIN(backoff * 2, GS_TX_BACKOFF_MAX);
+    }
+}
+
+int _gs_socket_isalive(int id)
+{
+    int res = 1;
+    int unack;
+    GSocket* sock;
+    sock = &gs_sockets[id];
+
+    vosSemWait(sock->lock);
+    if (sock->to_be_closed) {
+        //needs to be closed, set alive
+        res = 1;
+    } else if (sock->secure) {
+        //QSSLSEND does not support keepalive -_- (and QISEND does not apparently work with ssl)
+        //so we must return true
+        res = 1;
+    } else {
+        unack = _gs_socket_unacked_nolock(id, 0);
+        if (unack == -1) {
+            //error in command, assume it is not alive
+            res = 0;
+        } else if (unack > MAX_UNACKED_DATA) {
+            //TODO: this threshold should be settable from python one day, ideally through setsockopt
+            //but with some gotchas: it is not a real keepalive unless one end of the socket
+            //is always reading and the other one is sending periodically...
+            //To implement real keepalive, we need the modem to send empty packets, but this is apparently not possible :(
+            res = 0;
+        } else {
+            //alive, or bad response/generic error: assume it is still alive
+            res = 1;
+        }
+    }
+    vosSemSignal(sock->lock);
+
+    return res;
+}
+
+int _gs_socket_sendto(int id, uint8_t* buf, int len, struct sockaddr_in *addr, int nowait)
+{
+    int res = len;
+    int saddrlen;
+    GSSlot* slot;
+    GSocket* sock;
+    uint8_t remote_ip[16];
+    sock = &gs_sockets[id];
+
+    saddrlen = zs_addr_to_string(addr, remote_ip);
+
+    if (_gs_socket_lock(sock, nowait))
+        return ERR_WOULDBLOCK;
+    CHECK_SOCKET_OPEN(sock);
+
+    if (sock->to_be_closed) {
+        // _gs_socket_close_nolock(id);
+        res = -1;
+    } else if (nowait && !(slot = _gs_try_acquire_slot(GS_CMD_QISEND, NULL, 32, GS_TIMEOUT * 10, 1))) {
+        res = ERR_WOULDBLOCK;
+    } else {
+        if (!nowait)
+            slot = _gs_acquire_slot(GS_CMD_QISEND, NULL, 32, GS_TIMEOUT * 10, 1);
+        _gs_send_at(GS_CMD_QISEND, "=i,i,\"s\",i", id, len, remote_ip, saddrlen, OAL_GET_NETPORT(addr->sin_port));
+        res = _gs_wait_for_slot_mode(buf, len, NULL, 0);
+        if (res) {
+            //ouch!
+        } else {
+            res = len;
+        }
+        _gs_wait_for_slot();
+        if (slot->err) {
+            res = -1;
+        } else {
+            //check resp
+            if (memcmp(slot->resp, "SEND FAIL", 9) == 0) {
+                //buffer full!
+                res = 0;
+            }
+            //also check network status
+            if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
+                printf("closing socket forcibly from sendto\n");
+                _gs_socket_closing(id);
+            }
+        }
+        _gs_release_slot(slot);
+    }
+    vosSemSignal(sock->lock);
+
+    return res;
+}
+
+/**
+ * @brief Copy n bytes out of the rx ring of a socket
+ *
+ * @param[in]  sock the socket
+ * @param[in]  pos  ring position of the first byte
+ * @param[out] dst  where to copy
+ * @param[in]  n    the number of bytes
+ *
+ * @return the ring position following the copied bytes
+ */
+int _gs_ring_get(GSocket* sock, int pos, uint8_t* dst, int n)
+{
+    //at most two copies: up to the end of the ring, then from its beginning
+    int chunk = MIN(n, sock->rxsize - pos);
+    memcpy(dst, sock->rxbuf + pos, chunk);
+    if (chunk < n)
+        memcpy(dst + chunk, sock->rxbuf, n - chunk);
+    return (pos + n) % sock->rxsize;
+}
+
+/**
+ * @brief Copy n bytes in the rx ring of a socket
+ *
+ * @param[in] sock  the socket
+ * @param[in] pos   ring position of the first byte
+ * @param[in] src   the bytes
+ * @param[in] n     the number of bytes
+ *
+ * @return the ring position following the copied bytes
+ */
+int _gs_ring_put(GSocket* sock, int pos, uint8_t* src, int n)
+{
+    int chunk = MIN(n, sock->rxsize - pos);
+    memcpy(sock->rxbuf + pos, src, chunk);
+    if (chunk < n)
+        memcpy(sock->rxbuf, src + chunk, n - chunk);
+    return (pos + n) % sock->rxsize;
+}
+
+/**
+ * @brief Dequeue the oldest datagram of a UDP socket ring
+ *
+ * Datagram boundaries are kept: what exceeds buf is discarded with the rest of the datagram.
+ *
+ * @param[in]  id   the socket id
+ * @param[out] buf  where to store the payload
+ * @param[in]  len  size of buf
+ * @param[out] addr the sender address (can be NULL)
+ *
+ * @return the bytes copied, 0 if the queue is empty
+ */
+int _gs_dgram_copy(int id, uint8_t* buf, int len, struct sockaddr_in* addr)
+{
+    GSocket* sock;
+    GSDgram hdr;
+    int avail, head, rd;
+    sock = &gs_sockets[id];
+
+    //the main thread can append to the ring of push sockets: snapshot under ringlock
+    vosSemWait(gs.ringlock);
+    avail = sock->len;
+    head = sock->head;
+    vosSemSignal(gs.ringlock);
+    if (avail < GS_DGRAM_HDR)
+        return 0;
+    head = _gs_ring_get(sock, head, (uint8_t*)&hdr, GS_DGRAM_HDR);
+    rd = MIN(hdr.len, len);
+    if (rd > 0)
+        _gs_ring_get(sock, head, buf, rd);
+    if (addr)
+        memcpy(addr, &hdr.addr, sizeof(hdr.addr));
+    printf("DGRAM %i/%i\n", rd, hdr.len);
+    vosSemWait(gs.ringlock);
+    sock->head = (head + hdr.len) % sock->rxsize;
+    sock->len -= GS_DGRAM_HDR + hdr.len;
+    vosSemSignal(gs.ringlock);
+    return rd;
+}
+
+/**
+ * @brief Read a datagram
+ *
+ * @param[in]  id       the socket id
+ * @param[out] buf      where to store the payload
+ * @param[in]  len      size of buf
+ * @param[out] addr     the sender address
+ * @param[in]  timeout  if no datagram is available, max time to wait (ms) for the next one before returning.
+ *                      With 0 the call never blocks: ERR_WOULDBLOCK is returned if the serial port
+ *                      or the socket is busy
+ *
+ * @return the payload length, 0 if none, or a negative error
+ */
+int _gs_socket_recvfrom(int id, uint8_t* buf, int len, struct sockaddr_in *addr, int timeout){
+    int res = len;
+    int rd;
+    int nargs;
+    uint8_t* remote_ip;
+    int remote_len;
+    int remote_port;
+    GSSlot* slot;
+    GSocket* sock;
+
+    sock = &gs_sockets[id];
+    if (_gs_socket_lock(sock, !timeout))
+        return ERR_WOULDBLOCK;
+    CHECK_SOCKET_OPEN(sock);
+
+    rd = _gs_dgram_copy(id, buf, len, addr);
+    if (rd > 0) {
+        //skip command
+        res = rd;
+    } else if (sock->to_be_closed) {
+        // _gs_socket_close_nolock(id);
+        res = ERR_CLSD;
+    } else if (sock->push) {
+        //direct push: wait for the next urc
+        res = 0;
+    } else if (!timeout && !(slot = _gs_try_acquire_slot(GS_CMD_QIRD, NULL, 64, GS_TIMEOUT * 10, 1))) {
+        res = ERR_WOULDBLOCK;
+    } else {
+        //read from slot
+        if (timeout)
+            slot = _gs_acquire_slot(GS_CMD_QIRD, NULL, 64, GS_TIMEOUT * 10, 1);
+        _gs_send_at(GS_CMD_QIRD, "=i", id);
+        if (!_gs_wait_for_buffer_mode()) {
+            //oops, timeout
+            res = ERR_TIMEOUT;
+        }
+        nargs = _gs_parse_command_arguments(slot->resp, slot->eresp, "isi", &rd, &remote_ip, &remote_len, &remote_port);
+        printf("READ NARGS %i %i %i %i\n", nargs, rd, remote_len, remote_port);
+        if (nargs == 3) {
+            remote_len = MIN(15,(remote_len-2));
+            res = zs_string_to_addr(remote_ip+1, remote_len, addr);
+            addr->sin_port = OAL_GET_NETPORT(remote_port);
+            if (!res) {
+                //if no error in converting string to addr, assign res the read bytes count
+                res = MIN(rd, len);
+            } else {
+                res = -1;
+            }
+            //if buf not large enough, exceeding data is discarded
+            _gs_exit_from_buffer_mode_r(buf, len, rd, NULL);
+        } else {
+            if (nargs > 1 && rd == 0 && remote_len == 0) {
+                //no data
+                res = 0;
+            } else {
+                res = -1;
+            }
+            _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
+        }
+        _gs_wait_for_slot();
+        if (slot->err) {
+            res = -1;
+        }
+        _gs_release_slot(slot);
+    }
+
+    vosSemSignal(sock->lock);
+    if (res == 0) {
+        //no data arrived, wait with timeout
+        printf("Waiting for rx\n");
+        vosSemWaitTimeout(sock->rx, TIME_U(timeout, MILLIS));
+        //also check network status
+        if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
+            printf("closing socket forcibly from recvfrom\n");
             _gs_socket_closing(id);
+        }
+    }
+    return res;
+}
+
+int _gs_sock_copy(int id, uint8_t* buf, int len)
+{
+    GSocket* sock;
+    int rd, head;
+    sock = &gs_sockets[id];
+
+    printf("Sock copy\n");
+    //the main thread can append to the ring of push sockets: snapshot under ringlock
+    vosSemWait(gs.ringlock);
+    rd = MIN(sock->len, len);
+    head = sock->head;
+    vosSemSignal(gs.ringlock);
+    if (rd > 0) {
+        printf("COPY %i from %i to %i/%i\n", rd, head, (head + rd) % sock->rxsize, sock->len);
+        head = _gs_ring_get(sock, head, buf, rd);
+        vosSemWait(gs.ringlock);
+        sock->head = head;
+        sock->len -= rd;
+        vosSemSignal(gs.ringlock);
+    }
+    return rd;
+}
+
+/**
+ * @brief Read from a stream socket
+ *
+ * @param[in]  id       the socket id
+ * @param[out] buf      where to store data
+ * @param[in]  len      size of buf
+ * @param[in]  timeout  if no data is available, max time to wait (ms) for some before returning.
+ *                      A full KEEPALIVE_PERIOD without data triggers a keepalive check.
+ *                      With 0 the call never blocks: ERR_WOULDBLOCK is returned if the serial port
+ *                      or the socket is busy
+ *
+ * @return the bytes read (possibly 0) or a negative error
+ */
+int _gs_socket_recv(int id, uint8_t* buf, int len, int timeout)
+{
+    int trec = 0;
+    int res = len;
+    int rd;
+    int inbuf=0;
+    GSSlot* slot;
+    GSocket* sock;
+
+    sock = &gs_sockets[id];
+    if (_gs_socket_lock(sock, !timeout))
+        return ERR_WOULDBLOCK;
+    CHECK_SOCKET_OPEN(sock);
+    if (sock->txlen) {
+        //the peer may be waiting for buffered data before answering
+        _gs_socket_flush_nolock(id, !timeout);
+    }
+    if (gs.transparent == id + 1) {
+        //raw data on the serial port, don't keep the lock while waiting so that sends can proceed
+        vosSemSignal(sock->lock);
+        rd = _gs_transparent_recv(id, buf, len, timeout);
+        if (rd != ERR_CLSD)
+            return rd;
+        //connection lost: serve what preceded the NO CARRIER, then report the close
+        vosSemWait(sock->lock);
+    }
+    //read first the leftover from socket rx buffer
+recv_from_buf:
+    rd = (sock->proto == IPPROTO_UDP) ? _gs_dgram_copy(id, buf, len, NULL) : _gs_sock_copy(id, buf, len);
+    if (rd > 0) {
+        //skip command
+        res = rd;
+        if (sock->rxmore) {
+            //room in the ring again, fetch what the last prefetch left in the modem
+            sock->rxmore = 0;
+            _gs_worker_wake(id);
+        }
+    } else {
+        printf("Check remaining\n");
+        int avail = _gs_socket_available_nolock(id, !timeout);
+        if (avail == ERR_WOULDBLOCK) {
+            res = avail;
+        } else if(avail<=0) {
+            //if we are here there is no data in buffer and socket needs to be closed
+            if (sock->to_be_closed) {
+                // _gs_socket_close_nolock(id);
+                res = ERR_CLSD;
+            } else {
+                res=0;
+            }
         } else {
-            //check resp
-            if (memcmp(slot->resp, "SEND FAIL", 9) == 0) {
-                //buffer full!
-                res = 0;
+            res=0;
+            //read from slot: as much as fits the caller buffer and the (empty) ring
+            trec = MIN(MAX_SOCK_RX_LEN, len + sock->rxsize);
+            if (sock->secure) {
+                //avail is > 0, so for ssl, data is now in the socket buffer
+                goto recv_from_buf;
+                // slot = _gs_acquire_slot(GS_CMD_QSSLRECV, NULL, 64, GS_TIMEOUT * 10, 1);
+                // _gs_send_at(GS_CMD_QSSLRECV, "=i,i", id, trec);
+            } else {
+                slot = (timeout) ? _gs_acquire_slot(GS_CMD_QIRD, NULL, 64, GS_TIMEOUT * 10, 1) : _gs_try_acquire_slot(GS_CMD_QIRD, NULL, 64, GS_TIMEOUT * 10, 1);
+                if (!slot) {
+                    //port busy, data stays in the module (and rxready stays set)
+                    vosSemSignal(sock->lock);
+                    return ERR_WOULDBLOCK;
+                }
+                //cleared before reading, a "recv" urc arriving meanwhile sets it again
+                _gs_socket_rxready(id, 0);
+                _gs_send_at(GS_CMD_QIRD, "=i,i", id, trec);
             }
-            //also check network status
-            if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
-                printf("closing socket forcibly from send\n");
-                _gs_socket_closing(id);
+            if (!_gs_wait_for_buffer_mode()) {
+                //oops, timeout
+                res = ERR_TIMEOUT;
+                _gs_socket_rxready(id, 1);
+            }
+            if (_gs_parse_command_arguments(slot->resp, slot->eresp, "i", &rd) == 1) {
+                //get len bytes and leave the rest in the buffer
+                //if available bytes in the modem buffer are more than the read bytes
+                //we need to inform the rx semaphore to avoid useless waiting
+                res = MIN(len, rd);
+                if (avail>rd) {
+                    //trigger another
+                    _gs_socket_pending(id);
+                }
+                if(sock->proto==IPPROTO_UDP){
+                    //udp: what exceeds the caller buffer is discarded
+                    _gs_exit_from_buffer_mode_r(buf, res, rd, NULL);
+                } else {
+                    _gs_exit_from_buffer_mode_r(buf, res, rd, sock);
+                }
+            } else {
+                res = ERR_IF;
+                _gs_socket_rxready(id, 1);
+                _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
+            }
+            _gs_wait_for_slot();
+            if (slot->err) {
+                res = ERR_IF;
+                _gs_socket_rxready(id, 1);
             }
+            _gs_release_slot(slot);
         }
-        _gs_release_slot(slot);
     }
+    inbuf=sock->len;
     vosSemSignal(sock->lock);
+    if (res == 0 && len > 0 && inbuf==0) {
+
+        //due to the difference between socket_available between SSL and TCP, we need to check again here for availability
+        //for secure sockets...
+        if (sock->secure) { //<--- out of lock, but it's ok
+            if (_gs_socket_available(id)>0) {
+                _gs_socket_pending(id);
+            }
+        }
+        //need more data, wait with timeout
+        printf("Waiting for rx\n");
+        if (vosSemWaitTimeout(sock->rx, TIME_U(timeout, MILLIS)) == VRES_TIMEOUT && timeout >= KEEPALIVE_PERIOD) {
+            //timeout without incoming data
+            //it's a good place to send check for keepalives or check network reg status
+            printf("Keepalive check\n");
+            if ((!_gs_socket_isalive(id))||(IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG())) {
+                //oops, not alive!
+                printf("closing socket forcibly from recv\n");
+                _gs_socket_closing(id);
+            }
+        }
+    }
+    return res;
+}
 
+int _gs_socket_available(int id){
+    GSocket* sock;
+    int res;
+    sock = &gs_sockets[id];
+    vosSemWait(sock->lock);
+    CHECK_SOCKET_OPEN(sock);
+    res = _gs_socket_available_nolock(id, 0);
+    vosSemSignal(sock->lock);
     return res;
 }
 
-int _gs_socket_isalive(int id)
+/**
+ * @brief Bytes that can be read from a socket without waiting. The socket lock must be held
+ *
+ * @param[in] id        the socket id
+ * @param[in] nowait    if not 0, don't wait for the serial port (ERR_WOULDBLOCK is returned if busy)
+ *
+ * @return the available bytes or a negative error
+ */
+int _gs_socket_available_nolock(int id, int nowait)
 {
-    int res = 1;
+    int trec = 0;
+    int res = 0;
+    int cmd;
+    int total, rd, toberd;
     GSSlot* slot;
     GSocket* sock;
-    sock = &gs_sockets[id];
 
-    vosSemWait(sock->lock);
-    if (sock->to_be_closed) {
-        //needs to be closed, set alive
-        res = 1;
+    sock = &gs_sockets[id];
+    //read from buffer
+    if (sock->len > 0){
+        res = sock->len;
+//WATCH OUT: the following 2 lines were commented out
+    } else if (sock->to_be_closed) {
+        res = ERR_CLSD;
+    } else if (sock->push) {
+        //direct push: everything the module received is already in the ring
+        res = 0;
+    } else if (sock->prefetch) {
+        //the worker fills the ring on "recv" urc, nothing to ask the module
+        res = 0;
+    } else if (gs.transparent == id + 1) {
+        //raw data: don't touch the ring, it belongs to the receiving thread
+        res = gs.rxlen + vhalSerialAvailable(gs.serial);
+    } else if (!(gs.rxready & (1 << id))) {
+        //no "recv" urc since the module was last emptied
+        res = 0;
     } else {
-        uint32_t tot;
-        uint32_t ack;
-        uint32_t unack;
-        int cmdlen;
+        cmd = (sock->secure) ? GS_CMD_QSSLRECV : GS_CMD_QIRD;
+        slot = (nowait) ? _gs_try_acquire_slot(cmd, NULL, 64, GS_TIMEOUT * 10, 1) : _gs_acquire_slot(cmd, NULL, 64, GS_TIMEOUT * 10, 1);
+        if (!slot)
+            return ERR_WOULDBLOCK;
+        //cleared before asking, a "recv" urc arriving meanwhile sets it again
+        _gs_socket_rxready(id, 0);
         if (sock->secure) {
-            //QSSLSEND does not support keepalive -_- (and QISEND does not apparently work with ssl)
-            //so we must return true
-            res = 1;
-        } else {
-            slot = _gs_acquire_slot(GS_CMD_QISEND, NULL, 32, GS_TIMEOUT * 10, 1);
-            _gs_send_at(GS_CMD_QISEND, "=i,0", id);
-            cmdlen = 7;
-            _gs_wait_for_slot();
-            if (!slot->err) {
-                if (memcmp(slot->resp, slot->cmd, cmdlen) == 0) {
-                    //resp starts with +QISEND
-                    //we need to check this because +QISEND=id,0 answers in a different way
-                    //than +QISEND=id,len, so the loop cannot parse args correctly (GS_RES_STR vs GS_RES_STR_OK)
-                    slot->resp += 8; //increment resp until after the colon
-                    if (_gs_parse_command_arguments(slot->resp, slot->eresp, "iii", &tot, &ack, &unack) != 3) {
-                        //error in command, assume it is not alive
-                        res = 0;
-                    } else {
-                        //check unacks
-                        printf("isalive %i %i %i %i\n", id, tot, ack, unack);
-                        if (unack > MAX_UNACKED_DATA) {
-                            //TODO: this threshold should be settable from python one day, ideally through setsockopt
-                            //but with some gotchas: it is not a real keepalive unless one end of the socket
-                            //is always reading and the other one is sending periodically...
-                            //To implement real keepalive, we need the modem to send empty packets, but this is apparently not possible :(
-                            res = 0;
-                        } else {
-                            res = 1;
-                        }
+            //QSSLRECV id,0 is not supported -_-
+            //we can try to read a byte here and put it in the socket queue. It will be read later
+            _gs_send_at(GS_CMD_QSSLRECV, "=i,i", id, MIN(MAX_SOCK_RX_LEN, sock->rxsize));
+            if (!_gs_wait_for_buffer_mode()) {
+                //oops, timeout
+                res = ERR_TIMEOUT;
+            }
+            if (_gs_parse_command_arguments(slot->resp, slot->eresp, "i", &rd) == 1) {
+                if (rd>0) {
+                    //read one char
+                    sock->head=0;
+                    sock->len=0;
+                    printf("reading ssl buf %i\n",rd);
+                    _gs_exit_from_buffer_mode_r(sock->rxbuf, rd, rd, NULL);
+                    //put it in queue, which is empty or we won't have reached here
+                    sock->len=rd;
+                    sock->head=0;
+                    res=rd;
+                    if (rd == MIN(MAX_SOCK_RX_LEN, sock->rxsize)) {
+                        //a full read, there may be more
+                        _gs_socket_rxready(id, 1);
                     }
                 } else {
-                    //bad response...ignore and set alive
-                    res = 1;
+                    _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
+                    res = 0;
                 }
             } else {
-                //generic error...assume it is still alive
-                res = 1;
+                res = ERR_IF;
+                _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
             }
-            _gs_release_slot(slot);
+            
+        } else {
+            //TCP CASE
+            _gs_send_at(GS_CMD_QIRD, "=i,0", id);
+        
+            if (!_gs_wait_for_buffer_mode()) {
+                //oops, timeout
+                res = ERR_TIMEOUT;
+            } else {
+                if (_gs_parse_command_arguments(slot->resp, slot->eresp, "iii", &total, &rd, &toberd) == 3) {
+                    res = toberd;
+                    if (toberd > 0)
+                        _gs_socket_rxready(id, 1);
+                } else {
+                    res = -1;
+                }
+                _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
+            }
+        }
+
+        _gs_wait_for_slot();
+        if (slot->err) {
+            res = ERR_IF;
+        }
+        _gs_release_slot(slot);
+        if (res < 0) {
+            //unknown state, ask again next time
+            _gs_socket_rxready(id, 1);
+        }
+    }
+    if (res==0 && sock->to_be_closed) {
+        return ERR_CLSD;
+    }
+    return res;
+}
+
+void _gs_socket_closing(int id)
+{
+    GSocket* sock;
+    sock = &gs_sockets[id];
+
+    // vosSemWait(sock->lock);
+    sock->to_be_closed = 1;
+    vosSemSignal(sock->rx);
+    vosSemSignal(gs.selectlock);
+    // vosSemSignal(sock->lock);
+}
+
+void _gs_socket_pending(int id)
+{
+    GSocket* sock;
+    sock = &gs_sockets[id];
+    if (sock->prefetch) {
+        //readers are signaled by the worker once data is in the ring
+        _gs_worker_wake(id);
+        return;
+    }
+    if (!sock->push) {
+        //data waits in the module until read
+        _gs_socket_rxready(id, 1);
+    }
+    vosSemSignal(sock->rx);
+    vosSemSignal(gs.selectlock);
+}
+
+/**
+ * @brief Mark a socket as having (or not) data waiting in the module
+ *
+ * @param[in] id    the socket id
+ * @param[in] ready 1 if data is waiting
+ */
+void _gs_socket_rxready(int id, int ready)
+{
+    vosSemWait(gs.ringlock);
+    if (ready) {
+        gs.rxready |= (1 << id);
+    } else {
+        gs.rxready &= ~(1 << id);
+    }
+    vosSemSignal(gs.ringlock);
+}
+
+/**
+ * @brief Check from driver memory only if a recv on the socket would not block
+ *
+ * Closed and failed sockets are readable, so that recv reports the error.
+ *
+ * @param[in] id    the socket id
+ *
+ * @return 1 if readable, 0 if not, ERR_CONN if the socket does not exist
+ */
+int _gs_socket_readable(int id)
+{
+    GSocket* sock;
+    sock = &gs_sockets[id];
+
+    if (!sock->acquired)
+        return ERR_CONN;
+    if (sock->len > 0 || sock->to_be_closed || sock->connected == 2)
+        return 1;
+    if (sock->connected != 1)
+        return 0;
+    if (gs.transparent == id + 1)
+        return (gs.rxlen + vhalSerialAvailable(gs.serial)) > 0;
+    return (gs.rxready & (1 << id)) != 0;
+}
+
+/**
+ * @brief Check if a send on the socket would not block
+ *
+ * A tcp socket is writable while the unacked bytes (estimated from the data sent, and refreshed
+ * with QISEND=id,0 at most every GS_TX_REFRESH_TIME) plus the coalescing buffer fit the window.
+ * The window is checked only after a SEND FAIL, until the module has drained.
+ * Secure sockets can't be queried, so they are always writable once connected, as are closed
+ * and failed sockets, so that send reports the error.
+ *
+ * @param[in] id        the socket id
+ * @param[in] refresh   if not 0, the module can be queried
+ *
+ * @return 1 if writable, 0 if not, ERR_CONN if the socket does not exist
+ */
+int _gs_socket_writable(int id, int refresh)
+{
+    GSocket* sock;
+    int res;
+    sock = &gs_sockets[id];
+
+    if (!sock->acquired)
+        return ERR_CONN;
+    if (sock->to_be_closed || sock->connected == 2)
+        return 1;
+    if (sock->connected != 1)
+        return 0;
+    if (sock->secure || sock->proto != 6 || gs.transparent == id + 1 || !sock->txfull)
+        return 1;
+    res = (sock->unacked + sock->txlen) < sock->txcwnd;
+    if (!res && refresh && (uint32_t)(vosMillis() - sock->unackedtime) >= GS_TX_REFRESH_TIME) {
+        vosSemWait(sock->lock);
+        if (sock->acquired && sock->connected == 1 && !sock->to_be_closed) {
+            //select must not queue behind other commands: skip the refresh if the port is busy
+            _gs_socket_unacked_nolock(id, 1);
+            //don't query again too soon, even on failure
+            sock->unackedtime = vosMillis();
         }
+        res = (sock->unacked + sock->txlen) < sock->txcwnd;
+        vosSemSignal(sock->lock);
+    }
+    return res;
+}
+
+/**
+ * @brief Check if a socket has an exceptional condition (closed by the peer or connection failed)
+ *
+ * @param[in] id    the socket id
+ *
+ * @return 1 if in error, 0 if not, ERR_CONN if the socket does not exist
+ */
+int _gs_socket_excepted(int id)
+{
+    GSocket* sock;
+    sock = &gs_sockets[id];
+
+    if (!sock->acquired)
+        return ERR_CONN;
+    return sock->to_be_closed || sock->connected == 2;
+}
+
+/**
+ * @brief Move data from the module to the socket ring, up to the prefetch high-water mark
+ *
+ * Called by the worker thread only.
+ *
+ * @param[in] id    the socket id
+ */
+void _gs_socket_prefetch(int id)
+{
+    GSocket* sock;
+    GSSlot* slot;
+    int room, rd = 0, cmd, timedout = 0;
+    sock = &gs_sockets[id];
+
+    vosSemWait(sock->lock);
+    if (!sock->acquired || !sock->prefetch || !sock->connected || sock->to_be_closed) {
+        vosSemSignal(sock->lock);
+        return;
+    }
+    room = MIN(sock->prefetch - sock->len, MAX_SOCK_RX_LEN);
+    if (room <= 0) {
+        //ring above the high-water mark, recv will wake us again
+        sock->rxmore = 1;
+        vosSemSignal(sock->lock);
+        return;
+    }
+    cmd = (sock->secure) ? GS_CMD_QSSLRECV : GS_CMD_QIRD;
+    slot = _gs_acquire_slot(cmd, NULL, 64, GS_TIMEOUT * 10, 1);
+    _gs_send_at(cmd, "=i,i", id, room);
+    if (!_gs_wait_for_buffer_mode()) {
+        //oops, timeout: as in recv, the main thread must be resumed anyway
+        printf("prefetch timeout on %i\n", id);
+        timedout = 1;
+    }
+    if (_gs_parse_command_arguments(slot->resp, slot->eresp, "i", &rd) == 1) {
+        //the whole payload fits the ring
+        _gs_exit_from_buffer_mode_r(NULL, 0, rd, sock);
+    } else {
+        rd = 0;
+        _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
     }
+    _gs_wait_for_slot();
+    _gs_release_slot(slot);
+    printf("prefetched %i/%i on %i\n", rd, room, id);
+    //a full read (or a failed one) means the module may hold more
+    sock->rxmore = (rd == room) || timedout;
     vosSemSignal(sock->lock);
-
-    return res;
+    if (rd > 0) {
+        vosSemSignal(sock->rx);
+        vosSemSignal(gs.selectlock);
+    }
 }
 
-int _gs_socket_sendto(int id, uint8_t* buf, int len, struct sockaddr_in *addr)
+/**
+ * @brief Send the coalescing buffer of a socket if its oldest byte is older than GS_TX_FLUSH_TIME
+ *
+ * Called by the worker thread only.
+ *
+ * @param[in] id    the socket id
+ */
+void _gs_socket_flush_expired(int id)
 {
-    int res = len;
-    int saddrlen;
-    GSSlot* slot;
     GSocket* sock;
-    uint8_t remote_ip[16];
     sock = &gs_sockets[id];
 
-    saddrlen = zs_addr_to_string(addr, remote_ip);
-
     vosSemWait(sock->lock);
-    CHECK_SOCKET_OPEN(sock);
+    if (!sock->acquired || !sock->txlen) {
+        _gs_worker_flush(id, 0);
+    } else if ((uint32_t)(vosMillis() - sock->txtime) >= GS_TX_FLUSH_TIME) {
+        _gs_socket_flush_nolock(id, 0);
+    }
+    vosSemSignal(sock->lock);
+}
 
-    if (sock->to_be_closed) {
-        // _gs_socket_close_nolock(id);
-        res = -1;
-    } else {
-        slot = _gs_acquire_slot(GS_CMD_QISEND, NULL, 32, GS_TIMEOUT * 10, 1);
-        _gs_send_at(GS_CMD_QISEND, "=i,i,\"s\",i", id, len, remote_ip, saddrlen, OAL_GET_NETPORT(addr->sin_port));
-        res = _gs_wait_for_slot_mode(buf, len, NULL, 0);
-        if (res) {
-            //ouch!
+/**
+ * @brief Worker thread: serves the prefetch requests queued by _gs_worker_wake
+ * and flushes coalescing buffers armed by _gs_worker_flush
+ *
+ * Exit when the driver is deinitialized
+ */
+void _gs_worker_loop(void* args)
+{
+    int id;
+    uint32_t pending, txpending;
+
+    while (gs.initialized) {
+        if (gs.txpending) {
+            vosSemWaitTimeout(gs.workevt, TIME_U(GS_TX_FLUSH_TIME, MILLIS));
         } else {
-            res = len;
+            vosSemWait(gs.workevt);
         }
-        _gs_wait_for_slot();
-        if (slot->err) {
-            res = -1;
-        } else {
-            //check resp
-            if (memcmp(slot->resp, "SEND FAIL", 9) == 0) {
-                //buffer full!
-                res = 0;
-            }
-            //also check network status
-            if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
-                printf("closing socket forcibly from sendto\n");
-                _gs_socket_closing(id);
-            }
+        vosSemWait(gs.ringlock);
+        pending = gs.workpending;
+        gs.workpending = 0;
+        txpending = gs.txpending;
+        vosSemSignal(gs.ringlock);
+        for (id = 0; id < MAX_SOCKS; id++) {
+            if (pending & (1 << id))
+                _gs_socket_prefetch(id);
+            if (txpending & (1 << id))
+                _gs_socket_flush_expired(id);
         }
-        _gs_release_slot(slot);
     }
-    vosSemSignal(sock->lock);
-
-    return res;
+    vosSemWait(gs.ringlock);
+    gs.worker = NULL;
+    vosSemSignal(gs.ringlock);
 }
 
-int _gs_socket_recvfrom(int id, uint8_t* buf, int len, struct sockaddr_in *addr){
-    int res = len;
-    int rd;
-    int nargs;
-    uint8_t* remote_ip;
-    int remote_len;
-    int remote_port;
-    GSSlot* slot;
-    GSocket* sock;
+/**
+ * @brief Start the worker thread if needed. Must be called with gs.ringlock held
+ */
+void _gs_worker_start(void)
+{
+    if (gs.worker == NULL) {
+        printf("Starting worker thread\n");
+        gs.worker = vosThCreate(VM_DEFAULT_THREAD_SIZE, VOS_PRIO_NORMAL, _gs_worker_loop, NULL, NULL);
+        vosThResume(gs.worker);
+    }
+}
 
-    sock = &gs_sockets[id];
-    vosSemWait(sock->lock);
-    CHECK_SOCKET_OPEN(sock);
+/**
+ * @brief Queue a prefetch for a socket, starting the worker thread if needed
+ *
+ * @param[in] id    the socket id
+ */
+void _gs_worker_wake(int id)
+{
+    vosSemWait(gs.ringlock);
+    gs.workpending |= (1 << id);
+    _gs_worker_start();
+    vosSemSignal(gs.ringlock);
+    vosSemSignal(gs.workevt);
+}
 
-    rd = _gs_sock_copy(id, buf, len);
-    if (rd > 0) {
-        //skip command
-        res = rd;
-    } else if (sock->to_be_closed) {
-        // _gs_socket_close_nolock(id);
-        res = ERR_CLSD;
+/**
+ * @brief Arm or disarm the flush timer of a socket coalescing buffer
+ *
+ * @param[in] id    the socket id
+ * @param[in] arm   1 when data enters an empty buffer, 0 when the buffer is emptied
+ */
+void _gs_worker_flush(int id, int arm)
+{
+    vosSemWait(gs.ringlock);
+    if (arm) {
+        gs.txpending |= (1 << id);
+        _gs_worker_start();
     } else {
-        //read from slot
-        slot = _gs_acquire_slot(GS_CMD_QIRD, NULL, 64, GS_TIMEOUT * 10, 1);
-        _gs_send_at(GS_CMD_QIRD, "=i", id);
-        if (!_gs_wait_for_buffer_mode()) {
-            //oops, timeout
-            res = ERR_TIMEOUT;
+        gs.txpending &= ~(1 << id);
+    }
+    vosSemSignal(gs.ringlock);
+    if (arm)
+        vosSemSignal(gs.workevt);
+}
+
+/**
+ * @brief Store the payload of a direct push "recv" URC in the socket ring
+ *
+ * Called by the main thread only, right after the URC line: the next len bytes on the serial port
+ * are the payload. The consumer (_gs_sock_copy) never touches the free part of the ring, so data is copied
+ * out of ringlock and only the ring length is updated under it. The module can't be throttled in push mode,
+ * therefore bytes that do not fit the ring are discarded. On UDP sockets each payload is queued whole
+ * behind a GSDgram header, or dropped whole.
+ *
+ * @param[in] id    the socket id
+ * @param[in] len   the payload length
+ * @param[in] addr  the sender address (UDP only)
+ */
+void _gs_socket_push(int id, int len, struct sockaddr_in* addr)
+{
+    GSocket* sock;
+    GSDgram hdr;
+    uint8_t dummy[16];
+    int tail, room, chunk, stored = 0;
+
+    room = 0;
+    if (id >= 0 && id < MAX_SOCKS) {
+        sock = &gs_sockets[id];
+        vosSemWait(gs.ringlock);
+        if (sock->acquired && sock->push) {
+            room = sock->rxsize - sock->len;
+            tail = (sock->head + sock->len) % sock->rxsize;
         }
-        nargs = _gs_parse_command_arguments(slot->resp, slot->eresp, "isi", &rd, &remote_ip, &remote_len, &remote_port);
-        printf("READ NARGS %i %i %i %i\n", nargs, rd, remote_len, remote_port);
-        if (nargs == 3) {
-            remote_len = MIN(15,(remote_len-2));
-            res = zs_string_to_addr(remote_ip+1, remote_len, addr);
-            addr->sin_port = OAL_GET_NETPORT(remote_port);
-            if (!res) {
-                //if no error in converting string to addr, assign res the read bytes count
-                res = MIN(rd, len);
-            } else {
-                res = -1;
-            }
-            //if buf not large enough, exceeding data is discarded
-            _gs_exit_from_buffer_mode_r(buf, len, rd, NULL);
-        } else {
-            if (nargs > 1 && rd == 0 && remote_len == 0) {
-                //no data
-                res = 0;
+        vosSemSignal(gs.ringlock);
+        if (room > 0 && sock->proto == IPPROTO_UDP) {
+            if (len > 0 && room >= GS_DGRAM_HDR + len) {
+                hdr.len = len;
+                memcpy(&hdr.addr, addr, sizeof(hdr.addr));
+                tail = _gs_ring_put(sock, tail, (uint8_t*)&hdr, GS_DGRAM_HDR);
+                stored = GS_DGRAM_HDR;
+                room = len;
             } else {
-                res = -1;
+                room = 0;
             }
-            _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
         }
-        _gs_wait_for_slot();
-        if (slot->err) {
-            res = -1;
+    }
+    while (len > 0 && room > 0) {
+        chunk = MIN(len, room);
+        chunk = MIN(chunk, sock->rxsize - tail);
+        _gs_serial_read(sock->rxbuf + tail, chunk);
+        tail = (tail + chunk) % sock->rxsize;
+        stored += chunk;
+        room -= chunk;
+        len -= chunk;
+    }
+    if (len > 0) {
+        printf("push overflow on %i, dropping %i\n", id, len);
+        while (len > 0) {
+            chunk = MIN(len, sizeof(dummy));
+            _gs_serial_read(dummy, chunk);
+            len -= chunk;
         }
-        _gs_release_slot(slot);
     }
+    if (stored) {
+        vosSemWait(gs.ringlock);
+        sock->len += stored;
+        vosSemSignal(gs.ringlock);
+        _gs_socket_pending(id);
+    }
+}
 
-    vosSemSignal(sock->lock);
-    if (res == 0) {
-        //no data arrived, wait with timeout
-        printf("Waiting for rx\n");
-        vosSemWaitTimeout(sock->rx, TIME_U(5000, MILLIS));
-        //also check network status
-        if (IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG()){
-            printf("closing socket forcibly from recvfrom\n");
-            _gs_socket_closing(id);
+static const uint8_t gs_nocarrier[] = "\r\nNO CARRIER\r\n";
+#define GS_NOCARRIER_LEN (sizeof(gs_nocarrier) - 1)
+
+/**
+ * @brief Search the rx ring for the NO CARRIER the module emits when the transparent connection drops
+ *
+ * @param[out] hold  the offset of a partial match running up to the end of the ring, -1 if none
+ *
+ * @return the offset of the first complete match, -1 if none
+ */
+int _gs_transparent_carrier(int* hold)
+{
+    int start, k;
+
+    *hold = -1;
+    for (start = 0; start < gs.rxlen; start++) {
+        for (k = 0; k < GS_NOCARRIER_LEN && start + k < gs.rxlen; k++) {
+            if (gs.rxring[(gs.rxhead + start + k) % MAX_RX_RING] != gs_nocarrier[k])
+                break;
+        }
+        if (k == GS_NOCARRIER_LEN)
+            return start;
+        if (start + k == gs.rxlen) {
+            //may still become a NO CARRIER: no later complete match is possible either
+            *hold = start;
+            break;
         }
     }
-    return res;
+    return -1;
 }
 
-int _gs_sock_copy(int id, uint8_t* buf, int len)
+/**
+ * @brief Handle the loss of the transparent connection
+ *
+ * The pos bytes preceding the NO CARRIER are moved to the socket ring so that they can still be read
+ * in command mode (the caller checks that they fit), the NO CARRIER is discarded, the socket is marked
+ * as closed by the peer and the serial port is given back to the main thread together with the slot lock.
+ * Must be called with gs.ringlock held.
+ *
+ * @param[in] id   the socket id
+ * @param[in] pos  the offset of the NO CARRIER in the rx ring
+ */
+void _gs_transparent_closed(int id, int pos)
 {
     GSocket* sock;
-    int i, rd;
+    int tail, chunk;
     sock = &gs_sockets[id];
 
-    printf("Sock copy\n");
-    rd = 0;
-    if (sock->len > 0) {
-        rd = MIN(sock->len, len);
-        printf("COPY %i from %i to %i/%i\n", rd, sock->head, (sock->head + rd) % MAX_SOCK_RX_BUF, sock->len);
-        for (i = 0; i < rd; i++) {
-            *buf++ = sock->rxbuf[sock->head];
-            sock->head = (sock->head + 1) % MAX_SOCK_RX_BUF;
-        }
-        sock->len -= rd;
-        if (!sock->len) {
-            //reset buf
-            sock->head = 0;
-            sock->len = 0;
-        }
+    printf("Transparent connection %i lost\n", id);
+    while (pos > 0) {
+        tail = (sock->head + sock->len) % sock->rxsize;
+        chunk = MIN(pos, sock->rxsize - tail);
+        _gs_serial_read(sock->rxbuf + tail, chunk);
+        sock->len += chunk;
+        pos -= chunk;
     }
-    return rd;
+    _gs_serial_skip(GS_NOCARRIER_LEN);
+    gs.transparent = 0;
+    gs.mode = GS_MODE_NORMAL;
+    vosSemSignal(gs.bufmode);
+    vosSemSignal(gs.slotlock);
+    _gs_socket_closing(id);
 }
 
-int _gs_socket_recv(int id, uint8_t* buf, int len)
+/**
+ * @brief Write raw data to the socket in transparent mode
+ *
+ * Incoming data is drained first: if the module already reported NO CARRIER the connection is over
+ * and the data must not reach the module, which is back in command mode. The payload preceding the
+ * NO CARRIER is handed to the socket ring only if it fits, otherwise it stays in the rx ring for recv.
+ *
+ * @param[in] id    the socket id
+ * @param[in] buf   the data
+ * @param[in] len   the number of bytes
+ *
+ * @return the number of bytes written, ERR_CLSD if the connection was lost
+ */
+int _gs_transparent_send(int id, uint8_t* buf, int len)
 {
-    int trec = 0;
-    int res = len;
-    int rd;
-    int inbuf=0;
-    GSSlot* slot;
+    int pos, hold;
     GSocket* sock;
-
     sock = &gs_sockets[id];
-    vosSemWait(sock->lock);
-    CHECK_SOCKET_OPEN(sock);
-    //read first the leftover from socket rx buffer
-recv_from_buf:
-    rd = _gs_sock_copy(id, buf, len);
-    if (rd > 0) {
-        //skip command
-        res = rd;
-    } else {
-        printf("Check remaining\n");
-        int avail = _gs_socket_available_nolock(id);
-        if(avail<=0) {
-            //if we are here there is no data in buffer and socket needs to be closed
-            if (sock->to_be_closed) {
-                // _gs_socket_close_nolock(id);
-                res = ERR_CLSD;
-            } else {
-                res=0;
-            }
-        } else {
-            res=0;
-            //read from slot
-            trec = MAX_SOCK_RX_LEN;
-            if (sock->secure) {
-                //avail is > 0, so for ssl, data is now in the socket buffer
-                goto recv_from_buf;
-                // slot = _gs_acquire_slot(GS_CMD_QSSLRECV, NULL, 64, GS_TIMEOUT * 10, 1);
-                // _gs_send_at(GS_CMD_QSSLRECV, "=i,i", id, trec);
-            } else {
-                slot = _gs_acquire_slot(GS_CMD_QIRD, NULL, 64, GS_TIMEOUT * 10, 1);
-                _gs_send_at(GS_CMD_QIRD, "=i,i", id, trec);
-            }
-            if (!_gs_wait_for_buffer_mode()) {
-                //oops, timeout
-                res = ERR_TIMEOUT;
-            }
-            if (_gs_parse_command_arguments(slot->resp, slot->eresp, "i", &rd) == 1) {
-                //get len bytes and leave the rest in the buffer
-                //if available bytes in the modem buffer are more than the read bytes
-                //we need to inform the rx semaphore to avoid useless waiting
-                res = MIN(len, rd);
-                if (avail>rd) {
-                    //trigger another
-                    _gs_socket_pending(id);
-                }
-                _gs_exit_from_buffer_mode_r(buf, res, rd, sock);
-                if(sock->proto==IPPROTO_UDP){
-                    printf("udp: empty the buffer\n");
-                    sock->head=0;
-                    sock->len=0;
-                }
-            } else {
-                res = ERR_IF;
-                _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
-            }
-            _gs_wait_for_slot();
-            if (slot->err) {
-                res = ERR_IF;
-            }
-            _gs_release_slot(slot);
-        }
+
+    vosSemWait(gs.ringlock);
+    if (gs.transparent != id + 1) {
+        vosSemSignal(gs.ringlock);
+        return ERR_CLSD;
     }
-    inbuf=sock->len;
-    vosSemSignal(sock->lock);
-    if (res >= 0 && len > res && inbuf==0) {
+    _gs_rx_fill();
+    pos = _gs_transparent_carrier(&hold);
+    if (pos >= 0) {
+        if (sock->rxbuf && pos <= sock->rxsize - sock->len)
+            _gs_transparent_closed(id, pos);
+        vosSemSignal(gs.ringlock);
+        return ERR_CLSD;
+    }
+    vosSemWait(gs.sendlock);
+    vhalSerialWrite(gs.serial, buf, len);
+    vosSemSignal(gs.sendlock);
+    vosSemSignal(gs.ringlock);
+    return len;
+}
 
-        //due to the difference between socket_available between SSL and TCP, we need to check again here for availability
-        //for secure sockets...
-        if (sock->secure) { //<--- out of lock, but it's ok
-            if (_gs_socket_available(id)>0) {
-                _gs_socket_pending(id);
-            }
+/**
+ * @brief Read raw data from the socket in transparent mode
+ *
+ * The main thread is parked, so the rx ring and the serial port are shared only with
+ * _gs_transparent_send, under gs.ringlock. The NO CARRIER ending the connection is never
+ * returned as payload; bytes that could be its beginning are held back until either the rest
+ * arrives or the timeout expires.
+ *
+ * @param[in]  id       the socket id
+ * @param[out] buf      where to store the data
+ * @param[in]  len      the maximum number of bytes to read
+ * @param[in]  timeout  the number of milliseconds to wait for the first byte
+ *
+ * @return the number of bytes read (0 on timeout), ERR_CLSD if the connection was lost
+ */
+int _gs_transparent_read(int id, uint8_t* buf, int len, int timeout)
+{
+    int avail, pos, hold, rd;
+    uint32_t elapsed;
+    uint32_t tstart = vosMillis();
+
+    while (1) {
+        vosSemWait(gs.ringlock);
+        if (gs.transparent != id + 1) {
+            vosSemSignal(gs.ringlock);
+            return ERR_CLSD;
         }
-        //need more data, wait with timeout
-        printf("Waiting for rx\n");
-        if (vosSemWaitTimeout(sock->rx, TIME_U(KEEPALIVE_PERIOD, MILLIS)) == VRES_TIMEOUT) {
-            //timeout without incoming data
-            //it's a good place to send check for keepalives or check network reg status
-            printf("Keepalive check\n");
-            if ((!_gs_socket_isalive(id))||(IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG())) {
-                //oops, not alive!
-                printf("closing socket forcibly from recv\n");
-                _gs_socket_closing(id);
-            }
+        _gs_rx_fill();
+        pos = _gs_transparent_carrier(&hold);
+        if (pos == 0) {
+            _gs_transparent_closed(id, 0);
+            vosSemSignal(gs.ringlock);
+            return ERR_CLSD;
+        }
+        elapsed = vosMillis() - tstart;
+        if (pos > 0) {
+            avail = pos;
+        } else if (hold >= 0 && (vosMillis() - gs.rxtime) < GS_NOCARRIER_TIME) {
+            //a partial NO CARRIER that does not complete in time is payload after all
+            avail = hold;
+        } else {
+            avail = gs.rxlen;
+        }
+        if (avail) {
+            rd = _gs_serial_read(buf, MIN(avail, len));
+            vosSemSignal(gs.ringlock);
+            return rd;
         }
+        vosSemSignal(gs.ringlock);
+        if (!gs.rxlen && elapsed > timeout)
+            return 0;
+        _gs_wait_rx((gs.rxlen) ? GS_NOCARRIER_TIME : timeout - elapsed);
     }
-    return res;
 }
 
-int _gs_socket_available(int id){
-    GSocket* sock;
-    int res;
-    sock = &gs_sockets[id];
-    vosSemWait(sock->lock);
-    CHECK_SOCKET_OPEN(sock);
-    res = _gs_socket_available_nolock(id);
-    vosSemSignal(sock->lock);
-    return res;
+/**
+ * @brief Read raw data from the socket in transparent mode, see _gs_transparent_read
+ *
+ * The caller is counted in gs.transrecv for the whole read.
+ */
+int _gs_transparent_recv(int id, uint8_t* buf, int len, int timeout)
+{
+    int rd;
+
+    //_gs_exit_transparent_mode waits for the readers before giving the serial port back
+    vosSemWait(gs.ringlock);
+    gs.transrecv++;
+    vosSemSignal(gs.ringlock);
+    rd = _gs_transparent_read(id, buf, len, timeout);
+    vosSemWait(gs.ringlock);
+    gs.transrecv--;
+    vosSemSignal(gs.ringlock);
+    return rd;
 }
 
-int _gs_socket_available_nolock(int id)
+/**
+ * @brief Leave transparent mode and give the serial port back to the main thread
+ *
+ * Transparent readers and writers are stopped first and the ones in progress are waited for, so that
+ * nobody else touches the rx ring. Then the "+++" escape sequence is sent surrounded by the required
+ * guard times, whatever is still incoming (raw data and the "OK" to the escape) is discarded, the main
+ * thread is resumed and the slot lock held since the transparent connect is released.
+ * The connection is still open in command mode afterwards.
+ *
+ * @param[in] id    the socket id, nothing is done if it is not in transparent mode (anymore)
+ */
+void _gs_exit_transparent_mode(int id)
 {
-    int trec = 0;
-    int res = 0;
-    int total, rd, toberd;
-    GSSlot* slot;
-    GSocket* sock;
+    int readers;
+
+    vosSemWait(gs.ringlock);
+    if (gs.transparent != id + 1) {
+        //not transparent, or the carrier was lost and the port already given back
+        vosSemSignal(gs.ringlock);
+        return;
+    }
+    gs.transparent = 0;
+    vosSemSignal(gs.ringlock);
+    printf("Exiting transparent mode\n");
+    do {
+        vosSemWait(gs.ringlock);
+        readers = gs.transrecv;
+        vosSemSignal(gs.ringlock);
+        if (readers) {
+            //they notice the change at their next poll
+            vosSemSignal(gs.rxevt);
+            vosThSleep(TIME_U(GS_RX_POLL_FAST, MILLIS));
+        }
+    } while (readers);
+    vosThSleep(TIME_U(GS_ESCAPE_GUARD_TIME, MILLIS));
+    vosSemWait(gs.sendlock);
+    vhalSerialWrite(gs.serial, "+++", 3);
+    vosSemSignal(gs.sendlock);
+    vosThSleep(TIME_U(GS_ESCAPE_GUARD_TIME, MILLIS));
+    vosSemWait(gs.ringlock);
+    _gs_empty_rx();
+    gs.mode = GS_MODE_NORMAL;
+    vosSemSignal(gs.ringlock);
+    vosSemSignal(gs.bufmode);
+    vosSemSignal(gs.slotlock);
+}
 
+/**
+ * @brief Set a driver specific option on a socket
+ *
+ * @param[in] id        the socket id
+ * @param[in] optname   the option (SO_UG96_xxx)
+ * @param[in] value     the option value
+ *
+ * @return 0 on success, -1 for unknown options or invalid state
+ */
+int _gs_socket_setopt(int id, int optname, int value)
+{
+    GSocket* sock;
+    int res = -1;
+    if (id < 0 || id >= MAX_SOCKS)
+        return -1;
     sock = &gs_sockets[id];
-    //read from buffer
-    if (sock->len > 0){
-        res = sock->len;
-//WATCH OUT: the following 2 lines were commented out
-    } else if (sock->to_be_closed) {
-        res = ERR_CLSD;
-    } else {
-        if (sock->secure) {
-            //QSSLRECV id,0 is not supported -_-
-            //we can try to read a byte here and put it in the socket queue. It will be read later
-            slot = _gs_acquire_slot(GS_CMD_QSSLRECV, NULL, 64, GS_TIMEOUT * 10, 1);
-            _gs_send_at(GS_CMD_QSSLRECV, "=i,i", id,MAX_SOCK_RX_LEN);
-            if (!_gs_wait_for_buffer_mode()) {
-                //oops, timeout
-                res = ERR_TIMEOUT;
+
+    vosSemWait(sock->lock);
+    if (sock->acquired) {
+        switch (optname) {
+        case SO_UG96_PUSH:
+            //access mode is chosen at QIOPEN time
+            if (!sock->connected && !sock->bound && !sock->secure && !sock->prefetch) {
+                sock->push = (value) ? 1 : 0;
+                res = 0;
             }
-            if (_gs_parse_command_arguments(slot->resp, slot->eresp, "i", &rd) == 1) {
-                if (rd>0) {
-                    //read one char
-                    sock->head=0;
-                    sock->len=0;
-                    printf("reading ssl buf %i\n",rd);
-                    _gs_exit_from_buffer_mode_r(sock->rxbuf, rd, rd, NULL);
-                    //put it in queue, which is empty or we won't have reached here
-                    sock->len=rd;
-                    sock->head=0;
-                    res=rd;
-                } else {
-                    _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
-                    res = 0;
-                }
-            } else {
-                res = ERR_IF;
-                _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
+            break;
+        case SO_UG96_TRANSPARENT:
+            //only one tcp socket at a time can own the serial port
+            if (!sock->connected && !sock->bound && !sock->secure && !sock->prefetch && sock->proto == 6) {
+                sock->transparent = (value) ? 1 : 0;
+                res = 0;
             }
-            
-        } else {
-            //TCP CASE
-            slot = _gs_acquire_slot(GS_CMD_QIRD, NULL, 64, GS_TIMEOUT * 10, 1);
-            _gs_send_at(GS_CMD_QIRD, "=i,0", id);
-        
-            if (!_gs_wait_for_buffer_mode()) {
-                //oops, timeout
-                res = ERR_TIMEOUT;
-            } else {
-                if (_gs_parse_command_arguments(slot->resp, slot->eresp, "iii", &total, &rd, &toberd) == 3) {
-                    res = toberd;
-                } else {
-                    res = -1;
+            break;
+        case SO_RCVTIMEO:
+            if (value >= 0) {
+                sock->timeout = value;
+                res = 0;
+            }
+            break;
+        case SO_SNDTIMEO:
+            if (value >= 0) {
+                sock->sndtimeout = value;
+                res = 0;
+            }
+            break;
+        case SO_UG96_NODELAY:
+            sock->nodelay = (value) ? 1 : 0;
+            if (sock->nodelay && sock->txlen) {
+                _gs_socket_flush_nolock(id, 0);
+            }
+            res = 0;
+            break;
+        case SO_UG96_TXWIN:
+            if (value > 0) {
+                //at least one packet, or a sender could wait forever
+                sock->txwin = (value < MAX_SOCK_TX_LEN) ? MAX_SOCK_TX_LEN : value;
+                sock->txcwnd = sock->txwin;
+                res = 0;
+            }
+            break;
+        case SO_UG96_PREFETCH:
+            //tcp streams only: prefetching datagrams would merge them
+            if (!sock->push && !sock->transparent && sock->proto == 6 && value >= 0) {
+                sock->prefetch = MIN(value, sock->rxsize);
+                sock->rxmore = 0;
+                res = 0;
+                if (sock->prefetch && sock->connected) {
+                    //data may already be waiting in the module
+                    _gs_worker_wake(id);
                 }
-                _gs_exit_from_buffer_mode_r(NULL, 0, 0, NULL);
             }
+            break;
+        case SO_UG96_SSLCTX:
+            //the context is chosen at QSSLOPEN time
+            if (sock->secure && !sock->connected && !_gs_ssl_ctx_retain(value)) {
+                _gs_ssl_ctx_release(sock->sslctx);
+                sock->sslctx = value;
+                res = 0;
+            }
+            break;
+        case SO_RCVBUF:
+            //the ring can only be resized while empty
+            if (!sock->connected && !sock->bound && value > 0) {
+                sock->rxsize = MIN(value, MAX_SOCK_RX_BUF);
+                sock->prefetch = MIN(sock->prefetch, sock->rxsize);
+                sock->head = 0;
+                sock->len = 0;
+                res = 0;
+            }
+            break;
         }
-
-        _gs_wait_for_slot();
-        if (slot->err) {
-            res = ERR_IF;
-        }
-        _gs_release_slot(slot);
-    }
-    if (res==0 && sock->to_be_closed) {
-        return ERR_CLSD;
     }
+    vosSemSignal(sock->lock);
     return res;
 }
 
-void _gs_socket_closing(int id)
+/**
+ * @brief Get a driver specific option from a socket
+ *
+ * @param[in]  id        the socket id
+ * @param[in]  optname   the option (SO_UG96_xxx)
+ * @param[out] value     the option value
+ *
+ * @return 0 on success, -1 for unknown options
+ */
+int _gs_socket_getopt(int id, int optname, int* value)
 {
     GSocket* sock;
+    int res = -1;
+    if (id < 0 || id >= MAX_SOCKS)
+        return -1;
     sock = &gs_sockets[id];
 
-    // vosSemWait(sock->lock);
-    sock->to_be_closed = 1;
-    vosSemSignal(sock->rx);
-    // vosSemSignal(sock->lock);
-}
-
-void _gs_socket_pending(int id)
-{
-    GSocket* sock;
-    sock = &gs_sockets[id];
-    vosSemSignal(sock->rx);
-    vosSemSignal(gs.selectlock);
+    vosSemWait(sock->lock);
+    if (sock->acquired) {
+        switch (optname) {
+        case SO_UG96_PUSH:
+            *value = sock->push;
+            res = 0;
+            break;
+        case SO_UG96_TRANSPARENT:
+            *value = sock->transparent;
+            res = 0;
+            break;
+        case SO_UG96_PREFETCH:
+            *value = sock->prefetch;
+            res = 0;
+            break;
+        case SO_RCVTIMEO:
+            *value = sock->timeout;
+            res = 0;
+            break;
+        case SO_SNDTIMEO:
+            *value = sock->sndtimeout;
+            res = 0;
+            break;
+        case SO_UG96_NODELAY:
+            *value = sock->nodelay;
+            res = 0;
+            break;
+        case SO_UG96_TXWIN:
+            *value = sock->txwin;
+            res = 0;
+            break;
+        case SO_UG96_SSLCTX:
+            *value = sock->sslctx;
+            res = 0;
+            break;
+        case SO_RCVBUF:
+            *value = sock->rxsize;
+            res = 0;
+            break;
+        }
+    }
+    vosSemSignal(sock->lock);
+    return res;
 }
 
 int _gs_resolve(uint8_t* url, int len, uint8_t* addr)
@@ -2192,6 +4660,12 @@ int _gs_resolve(uint8_t* url, int len, uint8_t* addr)
         printf("SLOT ERROR\n");
         res = -1;
     }
+    //the result comes with urcs: let other threads use the serial port meanwhile
+    _gs_release_slot(slot);
+    if (res) {
+        vosSemSignal(gs.dnsmode);
+        return res;
+    }
     for (cnt = 0; cnt < 150; cnt++) {
         //wait at most 15s to resolve: max is 60s but the command often hangs
         vosThSleep(TIME_U(100, MILLIS));
@@ -2207,7 +4681,6 @@ int _gs_resolve(uint8_t* url, int len, uint8_t* addr)
         printf("DNS NOT READY\n");
         res = -1;
     }
-    _gs_release_slot(slot);
     vosSemSignal(gs.dnsmode);
     return res;
 }
@@ -2775,16 +5248,62 @@ int ug96_gzsock_close(int sock) {
     return _gs_socket_close(sock);
 }
 
+/**
+ * @brief Time left before the receive or send timeout of a socket expires
+ *
+ * @param[in] id        the socket id
+ * @param[in] send      1 for SO_SNDTIMEO, 0 for SO_RCVTIMEO
+ * @param[in] tstart    when the operation started
+ * @param[in] maxwait   cap of the returned value (and value used when no timeout is set)
+ *
+ * @return the milliseconds left, at most maxwait, 0 if expired
+ */
+int _gs_socket_timeout(int id, int send, uint32_t tstart, int maxwait)
+{
+    GSocket* sock;
+    uint32_t timeout, elapsed;
+    sock = &gs_sockets[id];
+
+    timeout = (send) ? sock->sndtimeout : sock->timeout;
+    if (!timeout)
+        return maxwait;
+    elapsed = vosMillis() - tstart;
+    if (elapsed >= timeout)
+        return 0;
+    return MIN(maxwait, timeout - elapsed);
+}
+
+/**
+ * @brief Check if an operation on a socket must not block (O_NONBLOCK or MSG_DONTWAIT)
+ */
+int _gs_socket_dontwait(int id, int flags)
+{
+    return (flags & MSG_DONTWAIT) || (id >= 0 && id < MAX_SOCKS && gs_sockets[id].nonblock);
+}
+
 int ug96_gzsock_send(int sock, const void *dataptr, size_t size, int flags) {
     int32_t wrt;
     int32_t tsnd;
     int32_t err=ERR_OK;
     uint8_t *buf = (uint8_t*) dataptr;
     int len = size;
+    int dontwait = _gs_socket_dontwait(sock, flags);
+    uint32_t tstart = vosMillis();
     wrt=0;
     while(wrt<len){
         tsnd = MIN(MAX_SOCK_TX_LEN,(len-wrt));
-        tsnd = _gs_socket_send(sock,buf+wrt,tsnd);
+        if (dontwait) {
+            if (!_gs_socket_writable(sock, 1)) {
+                return (wrt) ? wrt : ERR_WOULDBLOCK;
+            }
+        } else if (_gs_socket_wait_window(sock, tsnd, _gs_socket_timeout(sock, 1, tstart, KEEPALIVE_PERIOD)) == ERR_TIMEOUT) {
+            //don't hammer the module with sends bound to fail: wait for room in the window
+            return (wrt) ? wrt : ERR_TIMEOUT;
+        }
+        tsnd = _gs_socket_send(sock,buf+wrt,tsnd,dontwait);
+        if (tsnd == ERR_WOULDBLOCK || (tsnd == 0 && dontwait)) {
+            return (wrt) ? wrt : ERR_WOULDBLOCK;
+        }
         if (tsnd<0) {
             return -1;
         }
@@ -2799,10 +5318,14 @@ int ug96_gzsock_sendto(int sock, const void *dataptr, size_t size, int flags, co
     int32_t err=ERR_OK;
     uint8_t *buf = (uint8_t*) dataptr;
     uint16_t len = size;
+    int dontwait = _gs_socket_dontwait(sock, flags);
     wrt=0;
     while(wrt<len){
         tsnd = MIN(MAX_SOCK_TX_LEN,(len-wrt));
-        tsnd = _gs_socket_sendto(sock,buf+wrt,tsnd,(struct sockaddr_in *) to);
+        tsnd = _gs_socket_sendto(sock,buf+wrt,tsnd,(struct sockaddr_in *) to,dontwait);
+        if (tsnd == ERR_WOULDBLOCK || (tsnd == 0 && dontwait)) {
+            return (wrt) ? wrt : ERR_WOULDBLOCK;
+        }
         if (tsnd<0) {
             return -1;
         }
@@ -2814,11 +5337,19 @@ int ug96_gzsock_sendto(int sock, const void *dataptr, size_t size, int flags, co
 int ug96_gzsock_recv(int sock, void *mem, size_t len, int flags){
     int rb;
     int trec;
+    int wait;
+    int dontwait = _gs_socket_dontwait(sock, flags);
+    uint32_t tstart = vosMillis();
     uint8_t *buf = (uint8_t*) mem;
 
     rb=0;
     while(rb<len){
-        trec = _gs_socket_recv(sock,buf+rb,len-rb);
+        wait = (dontwait) ? 0 : _gs_socket_timeout(sock, 0, tstart, KEEPALIVE_PERIOD);
+        trec = _gs_socket_recv(sock,buf+rb,len-rb,wait);
+        if (trec == ERR_WOULDBLOCK && !dontwait) {
+            //port busy right when the receive timeout expired
+            trec = 0;
+        }
         if(trec<0) {
             // when closed return data already read if any
             if (trec==ERR_CLSD && rb > 0) return rb;
@@ -2826,6 +5357,17 @@ int ug96_gzsock_recv(int sock, void *mem, size_t len, int flags){
             return trec;
         }
         rb+=trec;
+        if (rb && !(flags & MSG_WAITALL)) {
+            //posix semantics: return what is available
+            break;
+        }
+        if (dontwait) {
+            return (rb) ? rb : ERR_WOULDBLOCK;
+        }
+        if (rb < len && !_gs_socket_timeout(sock, 0, tstart, KEEPALIVE_PERIOD)) {
+            //SO_RCVTIMEO expired: return what we have
+            return (rb) ? rb : ERR_TIMEOUT;
+        }
     }
     return rb;
 }
@@ -2833,13 +5375,22 @@ int ug96_gzsock_recv(int sock, void *mem, size_t len, int flags){
 int ug96_gzsock_recvfrom(int sock, void *mem, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen) {
     int rb;
     int trec;
+    int dontwait = _gs_socket_dontwait(sock, flags);
+    uint32_t tstart = vosMillis();
     uint8_t *buf = (uint8_t*) mem;
 
     rb=0;
     while(rb<len){
-        trec = _gs_socket_recvfrom(sock,buf+rb,len-rb,(struct sockaddr_in *) from);
+        trec = _gs_socket_recvfrom(sock,buf+rb,len-rb,(struct sockaddr_in *) from,(dontwait) ? 0 : _gs_socket_timeout(sock, 0, tstart, 5000));
+        if (trec == ERR_WOULDBLOCK && !dontwait) {
+            trec = 0;
+        }
         if (trec==0 && rb==0){
             //no data yet
+            if (dontwait)
+                return ERR_WOULDBLOCK;
+            if (!_gs_socket_timeout(sock, 0, tstart, 5000))
+                return ERR_TIMEOUT;
             continue;
         } else if(trec<0) {
             if (trec==ERR_CLSD) return rb;
@@ -2857,63 +5408,100 @@ int ug96_gzsock_select(int maxfdp1, void *readset, void *writeset, void *excepts
     uint64_t tstart;
     int32_t timeout;
     uint32_t timepast;
-    int32_t rdy = 0, sock = -1,r;
+    int32_t rdy, sock, r, wait, refresh, poll;
     fd_set *read_fds = (fd_set*) readset;
     fd_set *write_fds = (fd_set*) writeset;
     fd_set *exc_fds = (fd_set*) exceptset;
+    fd_set rin, win, ein;
 
     tstart = vosMillis();
     timeout = (tv) ? ((tv->tv_sec*1000)+(tv->tv_usec/1000)):(-1);
+    //sets are in/out: remember what was asked and report only what is ready
+    FD_ZERO(&rin);
+    FD_ZERO(&win);
+    FD_ZERO(&ein);
+    if (read_fds) {
+        memcpy(&rin, read_fds, sizeof(fd_set));
+        FD_ZERO(read_fds);
+    }
+    if (write_fds) {
+        memcpy(&win, write_fds, sizeof(fd_set));
+        FD_ZERO(write_fds);
+    }
+    if (exc_fds) {
+        memcpy(&ein, exc_fds, sizeof(fd_set));
+        FD_ZERO(exc_fds);
+    }
+    if (maxfdp1 > MAX_SOCKS)
+        maxfdp1 = MAX_SOCKS;
+    refresh = 0;
     while(1){
-        //let's try to avoid useless at commands
-        //enter immediately in the waiting loop
-        sock++;
-        if(sock>=maxfdp1) {
-            if (rdy) return rdy;
-            //reset and check timeout
-            sock=0;
-            if (timeout>=0) {
-                timepast = (uint32_t)(vosMillis()-tstart);
-                if(timepast>timeout) {
-                    //timeout expired
-                    return 0;
-                } else {
-                    //let's wait
-                    if(vosSemWaitTimeout(gs.selectlock,TIME_U((timeout-timepast),MILLIS))==VRES_TIMEOUT){
-                        //timeout passed
-                        printf("SELECT TIMEOUT EXPIRED\n");
-                        return 0;
-                    } else {
-                        printf("SELECT SEM SIGNALED\n");
-                        //go on and check sockets
-                    }
+        //readiness is tracked by the driver from urcs and socket rings: at commands are only
+        //used to refresh the tx window of sockets that are not writable
+        rdy = 0;
+        poll = 0;
+        for (sock = 0; sock < maxfdp1; sock++) {
+            if (FD_ISSET(sock, &rin)) {
+                r = _gs_socket_readable(sock);
+                if (r < 0) {
+                    //the socket does not exist
+                    //this is an error (man 2 select reports a EBADF in errno)
+                    //but we are good with a -1 :)
+                    return -1;
                 }
-            } else {
-                vosSemWait(gs.selectlock);
-            }
-            // if(timeout>=0 && ((vosMillis()-tstart)>timeout)) return 0;
-            // vosSemWaitTimeout(gs.selectlock,
-            // vosThSleep(TIME_U(100,MILLIS)); //sleep a bit
-            //TODO: consider using RD URC to signal data ready for each socket
-            //and suspend here, avoiding polling (quite cumbersome tough)
-        }
-        if(sock>=0&&sock<MAX_SOCKS){
-            r = _gs_socket_available(sock);
-            if (r>0 || r==ERR_CLSD) {
-                if(read_fds) {
+                if (r) {
                     FD_SET(sock, read_fds);
                     rdy++;
+                } else if (gs.transparent == sock + 1) {
+                    //nobody signals raw data of a transparent socket
+                    poll = 1;
                 }
-            } else {
-                //other return codes
-                if(r==ERR_CONN) {
-                    //the socket does not exist
-                    //this is an error (man 2 select reports a EBADF in errno)
-                    //but we are good with a -1 :)
+            }
+            if (FD_ISSET(sock, &win)) {
+                r = _gs_socket_writable(sock, refresh);
+                if (r < 0)
+                    return -1;
+                if (r) {
+                    FD_SET(sock, write_fds);
+                    rdy++;
+                } else if (gs_sockets[sock].connected == 1) {
+                    //acks are not signaled by the module
+                    poll = 1;
+                }
+            }
+            if (FD_ISSET(sock, &ein)) {
+                r = _gs_socket_excepted(sock);
+                if (r < 0)
                     return -1;
+                if (r) {
+                    FD_SET(sock, exc_fds);
+                    rdy++;
                 }
             }
         }
+        if (rdy) return rdy;
+        wait = (poll) ? GS_RX_POLL_IDLE : -1;
+        if (timeout>=0) {
+            timepast = (uint32_t)(vosMillis()-tstart);
+            if(timepast>=timeout) {
+                //timeout expired
+                return 0;
+            }
+            if (wait < 0 || wait > timeout - timepast)
+                wait = timeout - timepast;
+        }
+        if (wait >= 0) {
+            //let's wait
+            if(vosSemWaitTimeout(gs.selectlock,TIME_U(wait,MILLIS))==VRES_TIMEOUT){
+                printf("SELECT WAIT EXPIRED\n");
+            } else {
+                printf("SELECT SEM SIGNALED\n");
+            }
+        } else {
+            vosSemWait(gs.selectlock);
+        }
+        //from now on the tx window can be refreshed (rate limited by GS_TX_REFRESH_TIME)
+        refresh = 1;
     }
     return 0;
 }
@@ -2927,10 +5515,17 @@ int ug96_gzsock_write(int sock_id, const void *dataptr, size_t size) {
 }
 
 int ug96_gzsock_fcntl(int s, int cmd, int val) {
-    if (cmd != F_GETFL) {
+    if (s < 0 || s >= MAX_SOCKS) {
         return -1;
     }
-    return O_NONBLOCK;
+    if (cmd == F_GETFL) {
+        return (gs_sockets[s].nonblock) ? O_NONBLOCK : 0;
+    }
+    if (cmd == F_SETFL) {
+        gs_sockets[s].nonblock = (val & O_NONBLOCK) ? 1 : 0;
+        return 0;
+    }
+    return -1;
 }
 
 int ug96_gzsock_shutdown(int s, int how) {
@@ -2988,17 +5583,34 @@ void ug96_gzsock_freeaddrinfo(struct addrinfo *ai_res) {
 }
 
 int ug96_gzsock_setsockopt(int sock_id, int level, int optname, const void *optval, socklen_t optlen) {
-    if(optname != SO_RCVTIMEO)
+    if (!optval || optlen < sizeof(int))
         return -1;
-    // gTimeout = *((int*)optval);
-    return 0;
+    if ((optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) && optlen >= sizeof(struct timeval)) {
+        //timeouts are given in milliseconds or as a timeval
+        struct timeval* tv = (struct timeval*)optval;
+        return _gs_socket_setopt(sock_id, optname, tv->tv_sec * 1000 + tv->tv_usec / 1000);
+    }
+    if (level == IPPROTO_TCP && optname == TCP_NODELAY)
+        optname = SO_UG96_NODELAY;
+    return _gs_socket_setopt(sock_id, optname, *((int*)optval));
 }
 
 int ug96_gzsock_getsockopt(int sock_id, int level, int optname, void *optval, socklen_t *optlen) {
-    if (optname != SO_RCVTIMEO)
+    int res, value;
+    if (!optval || !optlen || *optlen < sizeof(int))
         return -1;
-    // optval = (void*) gTimeout;
-    return 0;
+    if ((optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) && *optlen >= sizeof(struct timeval)) {
+        struct timeval* tv = (struct timeval*)optval;
+        res = _gs_socket_getopt(sock_id, optname, &value);
+        tv->tv_sec = value / 1000;
+        tv->tv_usec = (value % 1000) * 1000;
+        *optlen = sizeof(struct timeval);
+        return res;
+    }
+    if (level == IPPROTO_TCP && optname == TCP_NODELAY)
+        optname = SO_UG96_NODELAY;
+    *optlen = sizeof(int);
+    return _gs_socket_getopt(sock_id, optname, (int*)optval);
 }
 
 int ug96_gzsock_bind(int sock, const struct sockaddr *name, socklen_t namelen){
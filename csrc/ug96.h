@@ -1,11 +1,15 @@
 #include "zerynth.h"
 
 #define ZERYNTH_SOCKETS
+// the UG96 supports up to 12 connect IDs
 #if !defined(UG96_MAX_SOCKS)
-#define MAX_SOCKS 4
+#define MAX_SOCKS 12
 #else
 #define MAX_SOCKS UG96_MAX_SOCKS
 #endif
+#if MAX_SOCKS > 12
+#error "UG96_MAX_SOCKS can't exceed the modem connect IDs (12)"
+#endif
 #include "zerynth_sockets.h"
 
 
@@ -30,17 +34,68 @@ static void debug_printf(const char* fmt, ...)
 
 
 #define MAX_BUF 1024
+// size of the driver owned serial receive ring
+#define MAX_RX_RING 512
 #define MAX_CMD 545
 // max out packet len supported by modem
 #define MAX_SOCK_TX_LEN 1460
-// max len of any packet read from modem
-#define MAX_SOCK_RX_BUF 256
-// request len for buffered reads (<=RX_BUF)
-#define MAX_SOCK_RX_LEN 256
+// size of the socket receive ring (max, it can be lowered per socket with SO_RCVBUF)
+#if !defined(UG96_SOCK_RX_BUF)
+#define MAX_SOCK_RX_BUF 1024
+#else
+#define MAX_SOCK_RX_BUF UG96_SOCK_RX_BUF
+#endif
+// size of the socket send coalescing buffer (at most MAX_SOCK_TX_LEN)
+#if !defined(UG96_SOCK_TX_BUF)
+#define MAX_SOCK_TX_BUF 512
+#else
+#define MAX_SOCK_TX_BUF UG96_SOCK_TX_BUF
+#endif
+#if MAX_SOCK_TX_BUF > MAX_SOCK_TX_LEN
+#error "UG96_SOCK_TX_BUF can't exceed the modem packet size (1460)"
+#endif
+// number of socket buffers (rx ring + tx buffer) shared by all sockets: it limits the sockets open at the same time,
+// so by default only 4 of the MAX_SOCKS sockets can be open together.
+// Each entry takes MAX_SOCK_RX_BUF + MAX_SOCK_TX_BUF bytes: 6 KB for the default pool (the old 256 bytes rx buffers took 1 KB)
+#if !defined(UG96_SOCK_POOL)
+#define GS_SOCK_POOL 4
+#else
+#define GS_SOCK_POOL UG96_SOCK_POOL
+#endif
+#if GS_SOCK_POOL > MAX_SOCKS
+#error "UG96_SOCK_POOL can't exceed UG96_MAX_SOCKS"
+#endif
+// max time (ms) small writes are held in the coalescing buffer
+#if !defined(UG96_TX_FLUSH_TIME)
+#define GS_TX_FLUSH_TIME 20
+#else
+#define GS_TX_FLUSH_TIME UG96_TX_FLUSH_TIME
+#endif
+// max request len for buffered reads (modem limit)
+#define MAX_SOCK_RX_LEN 1500
 #define MAX_OPS 6
 #define MAX_ERR_LEN 32
 #define GS_TIMEOUT 1000
 
+// rx polling periods of the modem thread (ms): fast while the link is busy, idle otherwise
+#if !defined(UG96_RX_POLL_FAST)
+#define GS_RX_POLL_FAST 1
+#else
+#define GS_RX_POLL_FAST UG96_RX_POLL_FAST
+#endif
+#if GS_RX_POLL_FAST < 1
+#error "UG96_RX_POLL_FAST must be at least 1 ms"
+#endif
+#if !defined(UG96_RX_POLL_IDLE)
+#define GS_RX_POLL_IDLE 20
+#else
+#define GS_RX_POLL_IDLE UG96_RX_POLL_IDLE
+#endif
+// the link is considered busy for this long (ms) after the last received byte
+#define GS_RX_HOT_TIME 200
+// transparent mode: trailing bytes that may start a NO CARRIER are held back this long (ms)
+#define GS_NOCARRIER_TIME 20
+
 typedef struct _gsm_socket {
     uint8_t acquired;
     uint8_t proto;
@@ -48,14 +103,109 @@ typedef struct _gsm_socket {
     uint8_t secure;
     uint8_t connected;
     uint8_t bound;
-    uint16_t timeout;
+    uint8_t push;
+    uint8_t transparent;
+    // set when the last prefetch left data in the modem
+    uint8_t rxmore;
+    // send every write immediately (TCP_NODELAY)
+    uint8_t nodelay;
+    // O_NONBLOCK
+    uint8_t nonblock;
+    // module ssl context used by QSSLOPEN, -1 if none (secure sockets only)
+    int8_t sslctx;
+    // buffered tx data was lost by a failed flush: reported by close
+    uint8_t txerr;
+    uint8_t unused[1];
+    // prefetch high-water mark in bytes, 0 if disabled
+    uint16_t prefetch;
+    // receive and send timeouts in ms (SO_RCVTIMEO/SO_SNDTIMEO), 0 waits forever
+    uint32_t timeout;
+    uint32_t sndtimeout;
     VSemaphore rx;
     VSemaphore lock;
-    uint8_t rxbuf[MAX_SOCK_RX_BUF];
+    // signaled by the QIOPEN/QSSLOPEN urc
+    VSemaphore opened;
+    // buffers claimed from the pool in _gs_socket_new, NULL when the socket is free
+    uint8_t* rxbuf;
+    uint16_t rxsize;
     uint16_t head;
     uint16_t len;
+    uint8_t* txbuf;
+    uint16_t txlen;
+    // time of the oldest byte in txbuf
+    uint32_t txtime;
+    // estimate of the bytes sent but not yet acked by the peer
+    uint32_t unacked;
+    // time of the last unacked refresh
+    uint32_t unackedtime;
+    // max unacked bytes (SO_UG96_TXWIN) and current adaptive window
+    uint32_t txwin;
+    uint32_t txcwnd;
+    // set by SEND FAIL, cleared when no byte is unacked: the window throttles sends only meanwhile
+    uint8_t txfull;
 } GSocket;
 
+// header of a datagram queued in the rx ring of a UDP socket, followed by len bytes of payload
+typedef struct _gs_dgram {
+    uint16_t len;
+    struct sockaddr_in addr;
+} GSDgram;
+
+#define GS_DGRAM_HDR ((int)sizeof(GSDgram))
+
+// number of uploaded files whose digest is remembered to skip uploading the same content again
+#if !defined(UG96_FILE_DIGESTS)
+#define MAX_FILE_DIGESTS 8
+#else
+#define MAX_FILE_DIGESTS UG96_FILE_DIGESTS
+#endif
+#define MAX_FILE_NAME 40
+
+// keep ssl certificates in the module flash (UFS) under content addressed names instead of RAM,
+// so that they survive a module restart and are uploaded only once (private keys always stay in RAM)
+#if !defined(UG96_CERT_STORE)
+#define GS_CERT_STORE 1
+#else
+#define GS_CERT_STORE UG96_CERT_STORE
+#endif
+// bytes of the SHA-256 of a certificate kept in its store name and in the ssl context identity
+#define GS_CERT_DIGEST_LEN 16
+// length of a certificate store name: UFS:<GS_CERT_DIGEST_LEN bytes in hex>.pem
+#define GS_CERT_NAME_LEN (8 + 2 * GS_CERT_DIGEST_LEN)
+
+// ssl contexts of the module (sslctxID 0-5), shared by secure sockets with the same configuration
+#define GS_SSL_CTXS 6
+
+// max length of one QSSLCFG setting and of a line of ';' joined settings (after "AT+QSSLCFG"),
+// longer settings fail without being sent
+#define GS_SSL_CFG_PARAM 80
+#define GS_SSL_CFG_LINE 240
+
+typedef struct _gs_ssl_cfg_batch {
+    uint8_t line[GS_SSL_CFG_LINE];
+    int len;
+    int err;
+} GSSslCfgBatch;
+
+typedef struct _gs_ssl_ctx {
+    // sockets and api users holding the context
+    uint8_t refs;
+    // references taken by the api (ssl_context), part of refs: only these can be freed by ssl_context_free
+    uint8_t apirefs;
+    uint8_t configured;
+    uint8_t authmode;
+    // SHA-256 (first GS_CERT_DIGEST_LEN bytes) of cacert, clicert and private key, zero if missing
+    uint8_t digest[3][GS_CERT_DIGEST_LEN];
+} GSSslCtx;
+
+typedef struct _gs_file_digest {
+    uint8_t name[MAX_FILE_NAME];
+    uint8_t namelen;
+    uint32_t len;
+    // FNV-1a of the content
+    uint32_t hash;
+} GSFileDigest;
+
 //COMMANDS
 
 #define MAKE_CMD(group, command, response) (((group) << 24) | ((command) << 16) | (response))
@@ -82,7 +232,8 @@ typedef struct _gs_slot {
     uint8_t has_params;
     uint8_t params;
     uint16_t max_size;
-    uint16_t unused2;
+    uint8_t busy;
+    uint8_t unused2;
     uint32_t stime;
     uint32_t timeout;
     uint8_t* resp;
@@ -126,6 +277,10 @@ typedef struct _gsm_status {
     uint8_t gprs_act;
     uint8_t errlen;
     uint8_t mode;
+    // id+1 of the socket in transparent mode, 0 if none
+    uint8_t transparent;
+    // threads inside _gs_transparent_recv (protected by ringlock)
+    uint8_t transrecv;
     uint8_t rssi;
     uint8_t serial;
     uint16_t dtr;
@@ -134,15 +289,42 @@ typedef struct _gsm_status {
     uint16_t tx;
     uint16_t bytes;
     GSSlot* slot;
+    // fifo of slots waiting for the serial port (indexes in the slot pool), the head is the active one
+    uint8_t slotq[MAX_SLOTS];
+    uint8_t slotqhead;
+    uint8_t slotqlen;
+    VSemaphore slotqlock;
+    VSemaphore slotfree;
     VSemaphore sendlock;
     VSemaphore slotlock;
     VSemaphore slotdone;
     VSemaphore bufmode;
+    VSemaphore prompt;
+    VSemaphore bufready;
     VSemaphore dnsmode;
     VSemaphore selectlock;
+    VSemaphore rxevt;
+    VSemaphore ringlock;
     VThread thread;
+    // background worker (rx prefetch, tx flush), started on first use
+    VThread worker;
+    VSemaphore workevt;
+    // bitmask of sockets waiting for a prefetch
+    uint32_t workpending;
+    // bitmask of sockets with data in the coalescing buffer
+    uint32_t txpending;
+    // bitmask of sockets with data waiting in the module (set by "recv" urc, cleared by reads that empty it)
+    uint32_t rxready;
+    // serializes uploads and the file digest cache
+    VSemaphore fslock;
+    // protects the ssl context table
+    VSemaphore ssllock;
     uint8_t errmsg[MAX_ERR_LEN];
     uint8_t buffer[MAX_BUF];
+    uint8_t rxring[MAX_RX_RING];
+    uint16_t rxhead;
+    uint16_t rxlen;
+    uint32_t rxtime;
     uint8_t dnsaddr[16];
     uint8_t dnsaddrlen;
     uint8_t dns_ready;
@@ -184,6 +366,7 @@ typedef struct _gsm_status {
 #define GS_MODE_NORMAL 0
 #define GS_MODE_PROMPT 1
 #define GS_MODE_BUFFER 2
+#define GS_MODE_TRANSPARENT 3
 
 #define GS_CMD_NORMAL 1
 #define GS_CMD_URC 2
@@ -191,6 +374,52 @@ typedef struct _gsm_status {
 
 #define GS_MAX_NETWORK_DOWN_TIME 60
 
+#if !defined(TCP_NODELAY)
+#define TCP_NODELAY 0x01
+#endif
+
+#if !defined(MSG_WAITALL)
+#define MSG_WAITALL 0x02
+#endif
+#if !defined(MSG_DONTWAIT)
+#define MSG_DONTWAIT 0x08
+#endif
+
+#if !defined(ERR_INPROGRESS)
+#define ERR_INPROGRESS -5
+#endif
+#if !defined(ERR_WOULDBLOCK)
+#define ERR_WOULDBLOCK -7
+#endif
+
+#if !defined(SO_SNDTIMEO)
+#define SO_SNDTIMEO 0x1005
+#endif
+#if !defined(SO_RCVTIMEO)
+#define SO_RCVTIMEO 0x1006
+#endif
+
+#if !defined(SO_RCVBUF)
+#define SO_RCVBUF 0x1002
+#endif
+
+// driver specific socket options (any level)
+// receive in direct push mode (QIOPEN access mode 1), must be set before connect
+#define SO_UG96_PUSH 0x9601
+// stream in transparent mode (QIOPEN access mode 2), must be set before connect
+// while a transparent socket is open every other AT command waits for its close
+#define SO_UG96_TRANSPARENT 0x9602
+// fetch data in background on "recv" urc, up to value bytes in the socket ring (0 disables)
+#define SO_UG96_PREFETCH 0x9603
+// disable send coalescing (mapped from TCP_NODELAY at IPPROTO_TCP level)
+#define SO_UG96_NODELAY 0x9604
+// max unacked bytes before senders wait (tcp, not secure)
+#define SO_UG96_TXWIN 0x9605
+// ssl context (from _gs_ssl_ctx_new) of a secure socket, must be set before connect
+#define SO_UG96_SSLCTX 0x9606
+// guard time around the "+++" escape sequence (ms)
+#define GS_ESCAPE_GUARD_TIME 1000
+
 //RESPONSES
 // only ok
 #define GS_RES_OK 0
@@ -229,6 +458,7 @@ enum {
     GS_CMD_QENG,
 
     GS_CMD_QFDEL,
+    GS_CMD_QFLST,
     GS_CMD_QFUPL,
 
     GS_CMD_QGPS,
@@ -289,6 +519,7 @@ static const GSCmd gs_commands[] = {
     DEF_CMD("+QENG", GS_RES_OK, GS_CMD_NORMAL, GS_CMD_QENG),
 
     DEF_CMD("+QFDEL", GS_RES_OK, GS_CMD_NORMAL, GS_CMD_QFDEL),
+    DEF_CMD("+QFLST", GS_RES_OK, GS_CMD_NORMAL, GS_CMD_QFLST),
     DEF_CMD("+QFUPL", GS_RES_OK, GS_CMD_NORMAL, GS_CMD_QFUPL),
 
     DEF_CMD("+QGPS", GS_RES_OK, GS_CMD_NORMAL, GS_CMD_QGPS),
@@ -323,6 +554,22 @@ extern int gsopn;
 #define KEEPALIVE_PERIOD 30000
 //if more than 1500 bytes are unacked in the last KEEPALIVE_PERIOD, consider connection broken
 #define MAX_UNACKED_DATA 1500
+//default max unacked bytes of a socket (tunable with SO_UG96_TXWIN, at least MAX_SOCK_TX_LEN)
+//the window is enforced only from a SEND FAIL until every byte is acked: the effective window
+//halves on each SEND FAIL and grows again each time the module is found drained
+#if !defined(UG96_TX_WINDOW)
+#define GS_TX_WINDOW 4096
+#else
+#define GS_TX_WINDOW UG96_TX_WINDOW
+#endif
+#if GS_TX_WINDOW < MAX_SOCK_TX_LEN
+#error "UG96_TX_WINDOW can't be smaller than the modem packet size (1460)"
+#endif
+//min interval (ms) between QISEND=id,0 used by select to refresh the unacked count
+#define GS_TX_REFRESH_TIME 200
+//backoff (ms) between QISEND=id,0 while a sender waits for room in the window
+#define GS_TX_BACKOFF_MIN 20
+#define GS_TX_BACKOFF_MAX 1000
 #define IS_NETWORK_UNREGISTERED_SINCE_TOO_LONG() ((gs.registered == GS_REG_NOT || gs.registered == GS_REG_DENIED) && ((((uint32_t)(vosMillis() / 1000)) - gs.registration_status_time) > GS_MAX_NETWORK_DOWN_TIME))
 
 
@@ -360,18 +607,33 @@ int _gs_local_ip(uint8_t* ip);
 int _gs_cell_info(int* mcc, int* mnc);
 
 int _gs_socket_connect(int id, struct sockaddr_in *addr);
+int _gs_socket_connect_many(int n, int* ids, struct sockaddr_in* addrs, int* results);
 int _gs_socket_new(int proto, int secure);
-int _gs_socket_send(int id, uint8_t* buf, int len);
-int _gs_socket_sendto(int id, uint8_t* buf, int len, struct sockaddr_in *addr);
-int _gs_socket_recv(int id, uint8_t* buf, int len);
-int _gs_socket_recvfrom(int id, uint8_t* buf, int len, struct sockaddr_in *addr);
+int _gs_socket_send(int id, uint8_t* buf, int len, int nowait);
+int _gs_socket_sendto(int id, uint8_t* buf, int len, struct sockaddr_in *addr, int nowait);
+int _gs_socket_recv(int id, uint8_t* buf, int len, int timeout);
+int _gs_socket_recvfrom(int id, uint8_t* buf, int len, struct sockaddr_in *addr, int timeout);
 int _gs_socket_available(int id);
-int _gs_socket_available_nolock(int id);
+int _gs_socket_available_nolock(int id, int nowait);
 int _gs_socket_close(int id);
 int _gs_resolve(uint8_t* url, int len, uint8_t* addr);
+int _gs_file_sync(uint8_t* filename, int namelen, uint8_t* content, int len);
+void _gs_file_digest_clear(void);
+int _gs_cert_store(uint8_t* fname, uint8_t* content, int len);
+int _gs_cert_is_name(uint8_t* content, int len);
+int _gs_cert_delete(uint8_t* content, int len);
+int _gs_cert_scan(void);
+int _gs_ssl_ctx_new(uint8_t* cacert, int cacertlen, uint8_t* clicert, int clicertlen, uint8_t* pvkey, int pvkeylen, int authmode);
+int _gs_ssl_ctx_retain(int ctx);
+void _gs_ssl_ctx_release(int ctx);
+int _gs_ssl_ctx_own(int ctx);
+int _gs_ssl_ctx_free(int ctx);
+void _gs_ssl_ctx_clear(void);
 int _gs_socket_tls(int id, uint8_t* cacert, int cacertlen, uint8_t* clicert, int clicertlen, uint8_t* pvkey, int pvkeylen, int authmode);
 int _gs_socket_bind(int id, struct sockaddr_in *addr);
 int _gs_socket_isalive(int id);
+int _gs_socket_setopt(int id, int optname, int value);
+int _gs_socket_getopt(int id, int optname, int* value);
 void _gs_socket_close_all(void);
 
 int _gs_sms_list(int unread, GSSMS* sms, int maxsms, int offset);
@@ -108,6 +108,9 @@ C_NATIVE(_ug96_startup){
     gs.gsm_status = 0;
     gs.gprs_status = 0;
     gs.registration_status_time = (uint32_t)(vosMillis() / 1000);
+    // files in module RAM and ssl configuration are gone
+    _gs_file_digest_clear();
+    _gs_ssl_ctx_clear();
 
     // start loop and wait
     if (_gs_start() != 0)
@@ -464,6 +467,235 @@ C_NATIVE(_ug96_link_info){
     return ERR_OK;
 }
 
+// /////////////////////SOCKET OPTIONS
+
+C_NATIVE(_ug96_setsockopt){
+    C_NATIVE_UNWARN();
+    int32_t sock;
+    int32_t level;
+    int32_t optname;
+    int32_t value;
+    int ret;
+    if (parse_py_args("iiii", nargs, args, &sock, &level, &optname, &value) != 4)
+        return ERR_TYPE_EXC;
+
+    *res = MAKE_NONE();
+    RELEASE_GIL();
+    ret = ug96_gzsock_setsockopt(sock, level, optname, &value, sizeof(value));
+    ACQUIRE_GIL();
+    if (ret < 0) {
+        //options handled by the driver report their failures, unknown standard options are ignored
+        if ((optname >= SO_UG96_PUSH && optname <= SO_UG96_SSLCTX) ||
+            optname == SO_RCVBUF || optname == SO_RCVTIMEO || optname == SO_SNDTIMEO ||
+            (level == IPPROTO_TCP && optname == TCP_NODELAY))
+            return ERR_VALUE_EXC;
+    }
+    return ERR_OK;
+}
+
+C_NATIVE(_ug96_getsockopt){
+    C_NATIVE_UNWARN();
+    int32_t sock;
+    int32_t level;
+    int32_t optname;
+    int value = 0;
+    socklen_t optlen = sizeof(value);
+    int ret;
+    if (parse_py_args("iii", nargs, args, &sock, &level, &optname) != 3)
+        return ERR_TYPE_EXC;
+
+    RELEASE_GIL();
+    ret = ug96_gzsock_getsockopt(sock, level, optname, &value, &optlen);
+    ACQUIRE_GIL();
+    if (ret < 0)
+        return ERR_UNSUPPORTED_EXC;
+    *res = PSMALLINT_NEW(value);
+    return ERR_OK;
+}
+
+// /////////////////////SSL CONTEXTS
+
+C_NATIVE(_ug96_ssl_ctx_new){
+    C_NATIVE_UNWARN();
+    uint8_t *cacert;
+    uint32_t cacertlen;
+    uint8_t *clicert;
+    uint32_t clicertlen;
+    uint8_t *pvkey;
+    uint32_t pvkeylen;
+    int32_t authmode;
+    int ctx;
+    if (parse_py_args("sssi", nargs, args, &cacert, &cacertlen, &clicert, &clicertlen, &pvkey, &pvkeylen, &authmode) != 4)
+        return ERR_TYPE_EXC;
+
+    RELEASE_GIL();
+    ctx = _gs_ssl_ctx_new(cacert, cacertlen, clicert, clicertlen, pvkey, pvkeylen, authmode);
+    if (ctx >= 0 && _gs_ssl_ctx_own(ctx) < 0)
+        ctx = -1;
+    ACQUIRE_GIL();
+    if (ctx < 0)
+        return ERR_IOERROR_EXC;
+    *res = PSMALLINT_NEW(ctx);
+    return ERR_OK;
+}
+
+C_NATIVE(_ug96_ssl_ctx_free){
+    C_NATIVE_UNWARN();
+    int32_t ctx;
+    if (parse_py_args("i", nargs, args, &ctx) != 1)
+        return ERR_TYPE_EXC;
+
+    *res = MAKE_NONE();
+    //only references returned by ssl_context can be freed
+    if (_gs_ssl_ctx_free(ctx) < 0)
+        return ERR_VALUE_EXC;
+    return ERR_OK;
+}
+
+// /////////////////////CERTIFICATE STORE
+
+C_NATIVE(_ug96_cert_store){
+    C_NATIVE_UNWARN();
+    uint8_t *cert;
+    uint32_t certlen;
+    uint8_t fname[GS_CERT_NAME_LEN];
+    int ret;
+    if (parse_py_args("s", nargs, args, &cert, &certlen) != 1)
+        return ERR_TYPE_EXC;
+
+    RELEASE_GIL();
+    ret = _gs_cert_store(fname, cert, certlen);
+    ACQUIRE_GIL();
+    if (ret < 0)
+        return ERR_IOERROR_EXC;
+    *res = pstring_new(ret, fname);
+    return ERR_OK;
+}
+
+C_NATIVE(_ug96_cert_delete){
+    C_NATIVE_UNWARN();
+    uint8_t *cert;
+    uint32_t certlen;
+    int ret;
+    if (parse_py_args("s", nargs, args, &cert, &certlen) != 1)
+        return ERR_TYPE_EXC;
+
+    *res = MAKE_NONE();
+    RELEASE_GIL();
+    ret = _gs_cert_delete(cert, certlen);
+    ACQUIRE_GIL();
+    if (ret)
+        return ERR_IOERROR_EXC;
+    return ERR_OK;
+}
+
+// /////////////////////BATCH CONNECT
+
+C_NATIVE(_ug96_connect_many){
+    C_NATIVE_UNWARN();
+    int ids[MAX_SOCKS];
+    int results[MAX_SOCKS];
+    struct sockaddr_in addrs[MAX_SOCKS];
+    PObject *item;
+    int n, i, j;
+    // args: tuple of socket ids, tuple of numeric ip strings, tuple of ports
+    if (nargs != 3)
+        return ERR_TYPE_EXC;
+    n = PSEQUENCE_ELEMENTS(args[0]);
+    if (n > MAX_SOCKS || PSEQUENCE_ELEMENTS(args[1]) != n || PSEQUENCE_ELEMENTS(args[2]) != n)
+        return ERR_VALUE_EXC;
+
+    for (i = 0; i < n; i++) {
+        item = PTUPLE_ITEM(args[0], i);
+        if (PTYPE(item) != PSMALLINT)
+            return ERR_TYPE_EXC;
+        ids[i] = PSMALLINT_VALUE(item);
+        for (j = 0; j < i; j++) {
+            //the same socket twice
+            if (ids[j] == ids[i])
+                return ERR_VALUE_EXC;
+        }
+        item = PTUPLE_ITEM(args[1], i);
+        if (zs_string_to_addr(PSEQUENCE_BYTES(item), PSEQUENCE_ELEMENTS(item), &addrs[i]) != ERR_OK)
+            return ERR_VALUE_EXC;
+        item = PTUPLE_ITEM(args[2], i);
+        if (PTYPE(item) != PSMALLINT)
+            return ERR_TYPE_EXC;
+        addrs[i].sin_port = OAL_GET_NETPORT(PSMALLINT_VALUE(item));
+    }
+
+    RELEASE_GIL();
+    _gs_socket_connect_many(n, ids, addrs, results);
+    ACQUIRE_GIL();
+
+    PTuple *tpl = ptuple_new(n, NULL);
+    for (i = 0; i < n; i++) {
+        PTUPLE_SET_ITEM(tpl, i, PSMALLINT_NEW(results[i]));
+    }
+    *res = tpl;
+    return ERR_OK;
+}
+
+// /////////////////////BATCH RECEIVE
+
+#define MAX_DGRAM_BATCH 16
+
+C_NATIVE(_ug96_recvfrom_many){
+    C_NATIVE_UNWARN();
+    int32_t sock;
+    int32_t maxcount;
+    int32_t size;
+    int lens[MAX_DGRAM_BATCH];
+    struct sockaddr_in addrs[MAX_DGRAM_BATCH];
+    socklen_t alen;
+    uint8_t saddr[16];
+    uint32_t saddrlen;
+    uint8_t *mem;
+    int n = 0, rd = 0, i;
+    if (parse_py_args("iii", nargs, args, &sock, &maxcount, &size) != 3)
+        return ERR_TYPE_EXC;
+    if (maxcount <= 0 || size <= 0)
+        return ERR_VALUE_EXC;
+    if (maxcount > MAX_DGRAM_BATCH)
+        maxcount = MAX_DGRAM_BATCH;
+    if (size > MAX_SOCK_RX_LEN)
+        //no datagram is larger than a module read
+        size = MAX_SOCK_RX_LEN;
+
+    mem = gc_malloc(maxcount * size);
+    if (!mem)
+        return ERR_MEMORY_EXC;
+    RELEASE_GIL();
+    while (n < maxcount) {
+        alen = sizeof(struct sockaddr_in);
+        //wait for the first datagram only, then take what is already there
+        rd = ug96_gzsock_recvfrom(sock, mem + n * size, size, (n) ? MSG_DONTWAIT : 0, (struct sockaddr*)&addrs[n], &alen);
+        if (rd <= 0)
+            break;
+        lens[n++] = rd;
+    }
+    ACQUIRE_GIL();
+    if (!n && rd < 0 && rd != ERR_TIMEOUT && rd != ERR_WOULDBLOCK) {
+        gc_free(mem);
+        return ERR_IOERROR_EXC;
+    }
+
+    PTuple *tpl = ptuple_new(n, NULL);
+    for (i = 0; i < n; i++) {
+        PTuple *dgram = ptuple_new(2, NULL);
+        PTuple *addr = ptuple_new(2, NULL);
+        saddrlen = zs_addr_to_string(&addrs[i], saddr);
+        PTUPLE_SET_ITEM(addr, 0, pstring_new(saddrlen, saddr));
+        PTUPLE_SET_ITEM(addr, 1, PSMALLINT_NEW(OAL_GET_NETPORT(addrs[i].sin_port)));
+        PTUPLE_SET_ITEM(dgram, 0, pbytes_new(lens[i], mem + i * size));
+        PTUPLE_SET_ITEM(dgram, 1, addr);
+        PTUPLE_SET_ITEM(tpl, i, dgram);
+    }
+    gc_free(mem);
+    *res = tpl;
+    return ERR_OK;
+}
+
 // /////////////////////DNS
 
 C_NATIVE(_ug96_resolve){
@@ -0,0 +1,70 @@
+################################################################################
+# UG96 RX Latency
+################################################################################
+
+import streams
+import socket
+import timers
+# import the gsm interface
+from wireless import gsm
+from quectel.ug96 import ug96 as ug96
+
+# Measure how fast the driver reacts to the module answers:
+# - AT round trip: a command whose answer is a single line (AT+CSQ)
+# - TCP round trip: a small write followed by the read of its echo
+#
+# It runs on a board wired to a real UG96, so the results include the module
+# and network times. Run it once with the default build and once with the
+# driver built with UG96_RX_POLL_FAST=50 and UG96_RX_POLL_IDLE=50, then compare
+# the averages. The comparison is approximate: the second build polls like the
+# old driver, but incoming bytes still wake the reader early, so it does not
+# reproduce the old fixed 50 ms polling exactly.
+
+streams.serial()
+
+# specify here the IP and port of a TCP echo server
+server_ip = "0.0.0.0"
+server_port = 7777
+rounds = 50
+
+def report(name, samples):
+    samples.sort()
+    total = 0
+    for s in samples:
+        total += s
+    print(name, "avg", total//len(samples), "min", samples[0], "max", samples[-1], "ms")
+
+try:
+    print("Initializing UG96...")
+    # init the ug96
+    # pins and serial port must be set according to your setup
+    ug96.init(SERIAL3,D12,D13,D67,D60,D37,D38,0)
+
+    print("Establishing Link...")
+    gsm.attach("your-apn-name")
+
+    t = timers.timer()
+    samples = []
+    for i in range(rounds):
+        t.start()
+        ug96.rssi()
+        samples.append(t.get())
+    report("AT round trip", samples)
+
+    sock = socket.socket()
+    sock.connect((server_ip,server_port))
+    samples = []
+    for i in range(rounds):
+        t.start()
+        sock.send("x")
+        sock.recv(1)
+        samples.append(t.get())
+    sock.close()
+    report("TCP round trip", samples)
+
+except Exception as e:
+    print("oops, exception!",e)
+
+while True:
+    print(".")
+    sleep(1000)
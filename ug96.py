@@ -24,6 +24,13 @@ The following functionalities are implemented:
 Listening sockets for TCP and UDP protocols are not implemented due to the nature of GSM networks. 
 Moreover, UDP sockets must be connected or bound explicitly in the code to select which kind of function to perform (send vs sendto and recv vs recvfrom).
 
+With the default build at most 4 sockets can be open at the same time. The module supports 12 (:samp:`UG96_MAX_SOCKS`),
+but socket buffers come from a shared pool of :samp:`UG96_SOCK_POOL` entries (4 by default): when the pool is exhausted,
+no more sockets can be opened until one is closed. To really use 12 sockets at once, build the driver with :samp:`UG96_SOCK_POOL`
+set to 12; each pool entry takes :samp:`UG96_SOCK_RX_BUF` + :samp:`UG96_SOCK_TX_BUF` bytes of RAM (1.5 KB by default).
+The default pool takes 6 KB of RAM (4 x 1.5 KB), while the previous fixed 256 bytes receive buffers of the 4 sockets took 1 KB:
+lower :samp:`UG96_SOCK_RX_BUF` and :samp:`UG96_SOCK_TX_BUF` to get closer to the old footprint.
+
 The communication with UG96 is performed via UART without hardware flow control at 115200 baud.
 
 This module provides the :samp:`ug96Exception` to signal errors related to the hardware initialization and management.
@@ -31,6 +38,16 @@ This module provides the :samp:`ug96Exception` to signal errors related to the h
    """
 import gpio
 
+# driver specific socket options
+SO_PUSH = 0x9601
+SO_TRANSPARENT = 0x9602
+SO_PREFETCH = 0x9603
+SO_TXWIN = 0x9605
+SO_SSLCTX = 0x9606
+IPPROTO_TCP = 6
+TCP_NODELAY = 0x01
+MSG_WAITALL = 0x02
+
 new_exception(ug96Exception, Exception)
 _reset_pin=None
 _reset_on=None
@@ -236,13 +253,98 @@ def gethostbyname(hostname):
 def socket(family,type,proto):
     pass
 
+@c_native("_ug96_setsockopt",[])
+def _setsockopt(sock,level,optname,value):
+    pass
+
 def setsockopt(sock,level,optname,value):
+    """
+.. function:: setsockopt(sock,level,optname,value)
+
+    Set a socket option. Besides the standard ones, the following driver specific options are supported:
+
+    * :samp:`SO_PUSH`, if *value* is non zero, received data is pushed by the UG96 as soon as it arrives (direct push mode)
+      instead of being fetched on demand. Must be set before connecting a TCP or UDP socket. Since the modem can't be throttled in this mode,
+      data exceeding the socket receive buffer is lost.
+    * :samp:`SO_RCVBUF`, the size of the socket receive buffer, up to the size selected at build time with :samp:`UG96_SOCK_RX_BUF` (1024 bytes by default).
+      Must be set before connecting. Larger buffers let each read from the modem fetch more data (up to 1500 bytes).
+    * :samp:`SO_TRANSPARENT`, if *value* is non zero, the next connect of a TCP socket switches the serial port to transparent mode:
+      sent and received bytes go straight through the UART without any AT framing. Only one socket at a time can be in transparent mode and,
+      until it is closed, every other driver operation (sockets, sms, network info) waits. Closing the socket sends the "+++" escape sequence
+      and restores AT control (it takes about two seconds because of the escape guard times).
+      A connection closed by the peer is detected from the "NO CARRIER" line the UG96 writes in the data stream: the following
+      receives and sends fail once the data received before it has been read. Since the detection is in band, a payload
+      containing the exact sequence "\\r\\nNO CARRIER\\r\\n" is taken as the end of the connection: don't use transparent mode
+      for streams that can contain it.
+    * :samp:`SO_PREFETCH`, if *value* is non zero, a background thread reads TCP data from the modem as soon as it is signaled,
+      keeping up to *value* bytes in the socket receive buffer. Reads are then served from memory without AT traffic. Can be set at any time,
+      *value* is limited by :samp:`SO_RCVBUF`.
+    * :samp:`SO_TXWIN`, the max number of bytes a TCP socket can have sent but not yet acknowledged by the peer
+      (:samp:`UG96_TX_WINDOW`, 4096 by default, minimum 1460). The window is applied only after the modem has reported a full buffer,
+      until all sent data is acknowledged, so sends are not slowed down while the modem keeps up. Meanwhile, when the window is full,
+      send waits for the modem to drain it, querying it with an increasing backoff, instead of retrying. The window in use shrinks
+      each time the modem reports a full buffer and grows back up to *value* while data is acknowledged.
+    * :samp:`SO_SSLCTX`, the SSL context (see :func:`ssl_context`) used by a secure socket. Must be set before connecting.
+    * :samp:`TCP_NODELAY` (at level :samp:`IPPROTO_TCP`), if *value* is non zero (the default), every send is transmitted immediately.
+      If set to zero, small writes on TCP sockets are collected (up to :samp:`UG96_SOCK_TX_BUF` bytes, 512 by default) and sent together
+      when the buffer fills, after :samp:`UG96_TX_FLUSH_TIME` milliseconds (20 by default), or before a receive or a close.
+      On close, buffered data is retried while the module buffer is full, for up to :samp:`SO_SNDTIMEO` (30 seconds if not set).
+      If buffered data can't be sent, the connection is treated as closed: the following sends and receives fail and
+      :samp:`close` raises an exception, so that the loss is never silent.
+
+    :exc:`ValueError` is raised if one of the options above can't be set (invalid value, or socket in the wrong state).
+    Other standard options are silently ignored.
+
+    """
+    if value is None:
+        value = 0
+    _setsockopt(sock,level,optname,value)
+
+@c_native("_ug96_getsockopt",[])
+def getsockopt(sock,level,optname):
+    """
+.. function:: getsockopt(sock,level,optname)
+
+    Return the value of a socket option set with :func:`setsockopt`.
+
+    """
     pass
 
 @native_c("py_net_connect",[])
 def connect(sock,addr):
     pass
 
+@c_native("_ug96_connect_many",[])
+def _connect_many(socks,ips,ports):
+    pass
+
+def connect_many(socks,addrs):
+    """
+.. function:: connect_many(socks,addrs)
+
+    Connect several sockets at once. *socks* is a list of sockets (socket objects or their channel ids) and *addrs* a list of :samp:`(host,port)` tuples,
+    one for each socket. The same socket can't appear twice.
+    All the connection requests are sent to the UG96 back to back and their completions are awaited together,
+    so that opening many connections takes about the time of the slowest one instead of the sum of all.
+
+    Returns a tuple with the outcome for each socket: 0 if connected, a negative number if the connection failed
+    (as with :func:`connect`, a socket that fails while waiting for the connection is closed and released: create a new one to retry). Non blocking sockets report the connection as in progress,
+    exactly like :func:`connect`. Sockets in transparent mode can't be connected in a batch.
+
+    """
+    ids = []
+    ips = []
+    ports = []
+    for sock in socks:
+        try:
+            ids.append(sock.channel)
+        except AttributeError:
+            ids.append(sock)
+    for addr in addrs:
+        ips.append(gethostbyname(addr[0]))
+        ports.append(addr[1])
+    return _connect_many(tuple(ids),tuple(ips),tuple(ports))
+
 @native_c("py_net_close",[])
 def close(sock):
     pass
@@ -267,6 +369,87 @@ def recv_into(sock,buf,bufsize,flags=0,ofs=0):
 def recvfrom_into(sock,buf,bufsize,flags=0,ofs=0):
     pass
 
+@c_native("_ug96_recvfrom_many",[])
+def recvfrom_many(sock,maxcount,bufsize):
+    """
+.. function:: recvfrom_many(sock,maxcount,bufsize)
+
+    Receive up to *maxcount* datagrams (at most 16) from the UDP socket *sock* with a single call.
+    The call waits for the first datagram like :func:`recvfrom_into` does, then collects the ones already received without waiting more.
+
+    Returns a tuple of :samp:`(data,(ip,port))` tuples, empty if nothing arrived before the receive timeout.
+    Each datagram is returned whole, up to *bufsize* bytes (at most 1500): the exceeding part is discarded.
+
+    Datagrams received in direct push mode (:samp:`SO_PUSH`) are queued in the socket receive buffer
+    together with their sender address (about 20 bytes each on top of the payload); datagrams that do not fit are dropped.
+
+    """
+    pass
+
+@c_native("_ug96_ssl_ctx_new",[])
+def _ssl_context(cacert,clicert,pvkey,authmode):
+    pass
+
+def ssl_context(cacert="",clicert="",pvkey="",authmode=0):
+    """
+.. function:: ssl_context(cacert="",clicert="",pvkey="",authmode=0)
+
+    Configure an SSL context of the UG96 and return its id. *cacert*, *clicert* and *pvkey* are the CA certificate,
+    the client certificate and the client private key in PEM format (empty if not needed), or the names returned by :func:`cert_store`
+    for certificates already in the UG96 flash; *authmode* is 0 for no verification, 1 to verify the server and 2 to verify server and client.
+
+    Unless the driver is built with :samp:`UG96_CERT_STORE` set to 0, CA and client certificates given as PEM are kept in the UG96 flash
+    (see :func:`cert_store`): after a module restart they are not sent over the UART again. Private keys given as PEM always stay in the module RAM.
+
+    The UG96 has 6 SSL contexts. A context already configured with the same certificates and *authmode* is shared instead of configured again.
+    Assign the context to any number of secure sockets with :samp:`setsockopt(sock,SOL_SOCKET,SO_SSLCTX,ctx)` before connecting them:
+    their connection then needs no further configuration. Release it with :func:`ssl_context_free` when no more sockets will use it.
+    Contexts are lost when the module is restarted (:func:`startup`) and must be created again.
+
+    """
+    return _ssl_context(cacert,clicert,pvkey,authmode)
+
+@c_native("_ug96_ssl_ctx_free",[])
+def ssl_context_free(ctx):
+    """
+.. function:: ssl_context_free(ctx)
+
+    Release the SSL context *ctx* returned by :func:`ssl_context`. Sockets already using it keep it until they are closed.
+    :exc:`ValueError` is raised if *ctx* is freed more times than it was returned by :func:`ssl_context`,
+    or if it was created before the last :func:`startup`.
+
+    """
+    pass
+
+@c_native("_ug96_cert_store",[])
+def cert_store(cert):
+    """
+.. function:: cert_store(cert)
+
+    Store the certificate (or private key) *cert* in the UG96 flash and return its file name, that can be given to :func:`ssl_context`
+    in place of the PEM content. The name is derived from the SHA-256 of the content: a certificate already in the flash is not uploaded again.
+    The first time the store is used after :func:`startup` the driver lists the stored certificates, so after a module restart
+    only new certificates are sent over the UART.
+
+    Unless the driver is built with :samp:`UG96_CERT_STORE` set to 0, the CA and client certificates of :func:`ssl_context`
+    are kept in this store too; private keys passed to :func:`ssl_context` as PEM always stay in the module RAM.
+    Certificates are never removed automatically: delete the ones no longer needed with :func:`cert_delete`.
+    Storing a private key with this function leaves it in the flash until it is deleted.
+
+    """
+    pass
+
+@c_native("_ug96_cert_delete",[])
+def cert_delete(cert):
+    """
+.. function:: cert_delete(cert)
+
+    Remove the certificate *cert* (its content or its store name) from the UG96 flash.
+    SSL contexts created with it are no longer usable for new connections: create them again.
+
+    """
+    pass
+
 @native_c("py_secure_socket",[],[])
 def secure_socket(family, type, proto, ctx):
     pass